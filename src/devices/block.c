@@ -139,6 +139,56 @@ block_write (struct block *block, block_sector_t sector, const void *buffer)
   block->write_cnt++;
 }
 
+/* Reads the CNT sectors from SECTOR on from BLOCK into BUFFER,
+   which must have room for CNT * BLOCK_SECTOR_SIZE bytes, in a
+   single transfer if the driver supports it.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_read_run (struct block *block, block_sector_t sector, size_t cnt,
+                void *buffer)
+{
+  uint8_t *p = buffer;
+  size_t i;
+
+  if (cnt == 0)
+    return;
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  if (cnt > 1 && block->ops->read_run != NULL)
+    block->ops->read_run (block->aux, sector, cnt, buffer);
+  else
+    for (i = 0; i < cnt; i++)
+      block->ops->read (block->aux, sector + i, p + i * BLOCK_SECTOR_SIZE);
+  block->read_cnt += cnt;
+}
+
+/* Writes the CNT sectors from SECTOR on to BLOCK from BUFFER,
+   which must contain CNT * BLOCK_SECTOR_SIZE bytes, in a single
+   transfer if the driver supports it.  Returns after the block
+   device has acknowledged receiving the data.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_write_run (struct block *block, block_sector_t sector, size_t cnt,
+                 const void *buffer)
+{
+  const uint8_t *p = buffer;
+  size_t i;
+
+  if (cnt == 0)
+    return;
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  ASSERT (block->type != BLOCK_FOREIGN);
+  if (cnt > 1 && block->ops->write_run != NULL)
+    block->ops->write_run (block->aux, sector, cnt, buffer);
+  else
+    for (i = 0; i < cnt; i++)
+      block->ops->write (block->aux, sector + i, p + i * BLOCK_SECTOR_SIZE);
+  block->write_cnt += cnt;
+}
+
 /* Returns the number of sectors in BLOCK. */
 block_sector_t
 block_size (struct block *block)
@@ -53,6 +53,9 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_run (struct block *, block_sector_t, size_t cnt, void *);
+void block_write_run (struct block *, block_sector_t, size_t cnt,
+                      const void *);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
@@ -65,6 +68,12 @@ struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+
+    /* Optional: transfer CNT consecutive sectors at once.  If
+       null, runs are moved a sector at a time with the above. */
+    void (*read_run) (void *aux, block_sector_t, size_t cnt, void *buffer);
+    void (*write_run) (void *aux, block_sector_t, size_t cnt,
+                       const void *buffer);
   };
 
 struct block *block_register (const char *name, enum block_type,
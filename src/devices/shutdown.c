@@ -11,7 +11,9 @@
 #endif
 #ifdef FILESYS
 #include "devices/block.h"
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
+#include "filesys/free-map.h"
 #endif
 
 /* Keyboard control register port. */
@@ -124,6 +126,8 @@ print_stats (void)
   thread_print_stats ();
 #ifdef FILESYS
   block_print_stats ();
+  cache_print_stats ();
+  free_map_print_stats ();
 #endif
   console_print_stats ();
   kbd_print_stats ();
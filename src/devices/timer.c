@@ -24,11 +24,16 @@ static int64_t ticks;
    Initialized by timer_calibrate(). */
 static unsigned loops_per_tick;
 
+/* Threads blocked in timer_sleep(), soonest wake-up first. */
+static struct list sleep_list;
+
 static intr_handler_func timer_interrupt;
 static bool too_many_loops (unsigned loops);
 static void busy_wait (int64_t loops);
 static void real_time_sleep (int64_t num, int32_t denom);
 static void real_time_delay (int64_t num, int32_t denom);
+static bool wakeup_less (const struct list_elem *, const struct list_elem *,
+                         void *);
 
 /* Sets up the timer to interrupt TIMER_FREQ times per second,
    and registers the corresponding interrupt. */
@@ -36,6 +41,7 @@ void
 timer_init (void) 
 {
   pit_configure_channel (0, 2, TIMER_FREQ);
+  list_init (&sleep_list);
   intr_register_ext (0x20, timer_interrupt, "8254 Timer");
 }
 
@@ -85,15 +91,34 @@ timer_elapsed (int64_t then)
 }
 
 /* Sleeps for approximately TICKS timer ticks.  Interrupts must
-   be turned on. */
+   be turned on.  The thread is blocked, not spinning, until the
+   timer interrupt wakes it. */
 void
 timer_sleep (int64_t ticks) 
 {
   int64_t start = timer_ticks ();
+  struct thread *cur = thread_current ();
+  enum intr_level old_level;
 
   ASSERT (intr_get_level () == INTR_ON);
-  while (timer_elapsed (start) < ticks) 
-    thread_yield ();
+  if (ticks <= 0)
+    return;
+
+  old_level = intr_disable ();
+  cur->wakeup_tick = start + ticks;
+  list_insert_ordered (&sleep_list, &cur->elem, wakeup_less, NULL);
+  thread_block ();
+  intr_set_level (old_level);
+}
+
+/* Orders sleeping threads by the tick they want to wake up at. */
+static bool
+wakeup_less (const struct list_elem *a_, const struct list_elem *b_,
+             void *aux UNUSED)
+{
+  const struct thread *a = list_entry (a_, struct thread, elem);
+  const struct thread *b = list_entry (b_, struct thread, elem);
+  return a->wakeup_tick < b->wakeup_tick;
 }
 
 /* Sleeps for approximately MS milliseconds.  Interrupts must be
@@ -171,6 +196,15 @@ static void
 timer_interrupt (struct intr_frame *args UNUSED)
 {
   ticks++;
+  while (!list_empty (&sleep_list))
+    {
+      struct thread *t = list_entry (list_front (&sleep_list),
+                                     struct thread, elem);
+      if (t->wakeup_tick > ticks)
+        break;
+      list_pop_front (&sleep_list);
+      thread_unblock (t);
+    }
   thread_tick ();
 }
 
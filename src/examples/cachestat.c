@@ -0,0 +1,20 @@
+/* cachestat.c
+
+   Prints the kernel's buffer cache counters. */
+
+#include <stdio.h>
+#include <syscall.h>
+
+int
+main (void) 
+{
+  struct cache_stats s;
+
+  cachestat (&s);
+  printf ("hits %lld (read ahead %lld), misses %lld\n",
+          s.hits, s.readahead_hits, s.misses);
+  printf ("evictions %lld, writebacks %lld\n", s.evictions, s.writebacks);
+  printf ("lock contended %lld times, %lld ticks waited\n",
+          s.lock_waits, s.lock_wait_ticks);
+  return EXIT_SUCCESS;
+}
@@ -37,6 +37,11 @@ main (int argc, char *argv[])
       return EXIT_FAILURE;
     }
 
+  /* Stream the copy past the buffer cache; it would only evict
+     sectors that other programs are using. */
+  directio (in_fd, true);
+  directio (out_fd, true);
+
   /* Copy data. */
   for (;;) 
     {
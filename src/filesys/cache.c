@@ -1,80 +1,937 @@
 #include "filesys/filesys.h"
 #include "filesys/cache.h"
+#include "filesys/inode.h"
+#include <debug.h>
+#include <round.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
 #include "userprog/syscall.h"
 #include "userprog/pagedir.h"
 
-void cache_init()
+int cache_flush_interval = CACHE_FLUSH_INTERVAL;
+enum cache_policy cache_policy = CACHE_CLOCK;
+int cache_capacity = CACHE_LIMIT;
+int cache_percent;
+
+/* Sector buffers come a page at a time: entries
+   [k * SECTORS_PER_PAGE, (k + 1) * SECTORS_PER_PAGE) share the
+   page at cache[k * SECTORS_PER_PAGE].addr, or all have a null
+   addr if that chunk is not backed. */
+#define SECTORS_PER_PAGE (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* The cache only grows while more than 1/CACHE_RESERVE of the
+   kernel pool is free. */
+#define CACHE_RESERVE 4
+
+static int cache_cnt;						/* Entries currently backed. */
+static struct list cache_free;				/* Backed entries holding no sector. */
+
+/* Metadata entries are passed over by eviction while there are at
+   most META_LIMIT of them; beyond that they compete with data. */
+#define META_LIMIT (cache_cnt / 2)
+static int meta_cnt;						/* Entries of type CACHE_META. */
+
+static struct cache_stats stats;
+
+/* Index from sector number to the cache entry holding it, so that
+   a lookup costs the same however many entries the cache has.
+   Entries are in it from the moment they start LOADING. */
+static struct hash cache_map;
+
+/* Next entry the second chance sweep looks at. */
+static int clock_hand;
+
+/* Signaled whenever an entry may have become evictable, for
+   threads that found every entry pinned or busy. */
+static struct condition cache_avail;
+
+/* 2Q replacement state (see Johnson and Shasha, "2Q: A Low
+   Overhead High Performance Buffer Management Replacement
+   Algorithm").  A sector seen once goes on a1in, a FIFO.  If it is
+   evicted from there its number is remembered on the a1out ghost
+   FIFO, and if it is asked for again while still remembered it is
+   loaded into am, an LRU list of sectors known to be reused.  A
+   long scan therefore only churns a1in and cannot push the hot
+   sectors out of am. */
+#define A1IN_LIMIT (cache_cnt / 4)
+#define A1OUT_LIMIT (cache_capacity / 2)
+static struct list a1in;					/* Resident, seen once. Front is newest. */
+static int a1in_cnt;						/* Entries on a1in. */
+static struct list am;						/* Resident, reused. Front is most recent. */
+
+/* A sector recently evicted from a1in. */
+struct cache_ghost
+{
+	block_sector_t sector_id;
+	struct hash_elem hash_elem;				/* Element in ghost_map. */
+	struct list_elem elem;					/* Element in a1out. */
+};
+static struct cache_ghost *ghosts;
+static struct list a1out;					/* Ghosts in use. Front is newest. */
+static struct list ghost_free;				/* Ghosts not in use. */
+static struct hash ghost_map;				/* Ghosts in use, by sector. */
+
+/* Most sectors cache_read_direct() and cache_write_direct() handle
+   at once.  Longer runs are taken a piece at a time, so that only
+   so many cached copies are pinned together. */
+#define DIRECT_RUN_MAX 32
+
+/* Sectors waiting to be read ahead, as a ring buffer.  When it is
+   full new requests are dropped; read-ahead is only a hint. */
+#define READAHEAD_QUEUE 64
+static block_sector_t ra_queue[READAHEAD_QUEUE];
+static int ra_head, ra_cnt;
+static struct lock ra_lock;
+static struct condition ra_cond;
+
+static void cache_readahead_daemon(void *aux);
+static unsigned ghost_hash(const struct hash_elem *e, void *aux);
+static bool ghost_less(const struct hash_elem *a, const struct hash_elem *b, void *aux);
+static bool cache_grow(bool force);
+static bool cache_reclaim(size_t page_cnt);
+
+/* Write-behind scratch space, cache_capacity entries each. */
+static int *flush_order;
+static block_sector_t *flush_sector;
+
+/* Held by the write-behind thread for the length of each pass.
+   Once flush_stopped is set under it, no further pass starts. */
+static struct lock flush_lock;
+static bool flush_stopped;
+
+/* Allocates the entries and indexes for cache_capacity sectors,
+   or cache_percent of the kernel pool if that is set, and backs
+   the first page of them. */
+static void cache_setup(void)
 {
 	int i;
-	for(i=0; i<CACHE_LIMIT; i++)
+
+	if(cache_percent > 0)
+		cache_capacity = palloc_pool_size(0) * cache_percent / 100 * SECTORS_PER_PAGE;
+	cache_capacity = ROUND_UP(cache_capacity, SECTORS_PER_PAGE);
+	if(cache_capacity < SECTORS_PER_PAGE)
+		cache_capacity = SECTORS_PER_PAGE;
+
+	cache = malloc(sizeof *cache * cache_capacity);
+	ghosts = malloc(sizeof *ghosts * A1OUT_LIMIT);
+	flush_order = malloc(sizeof *flush_order * cache_capacity);
+	flush_sector = malloc(sizeof *flush_sector * cache_capacity);
+	if(cache == NULL || ghosts == NULL || flush_order == NULL || flush_sector == NULL)
+		PANIC("can't allocate buffer cache");
+
+	for(i=0; i<cache_capacity; i++)
 	{
-		cache[i].addr = malloc(BLOCK_SECTOR_SIZE);
+		cache[i].addr = NULL;
+		cache[i].state = CACHE_FREE;
+		cache[i].type = CACHE_DATA;
 		cache[i].accessed = false;
-		cache[i].dirty = false;
+		cache[i].prefetched = false;
 		cache[i].open_cnt = 0;
 		cache[i].sector_id = -1;
+		cond_init(&cache[i].io_done);
+		cache[i].queue = NULL;
 	}
+	cache_cnt = 0;
+	meta_cnt = 0;
+	list_init(&cache_free);
+	clock_hand = 0;
+
+	list_init(&a1in);
+	a1in_cnt = 0;
+	list_init(&am);
+	list_init(&a1out);
+	list_init(&ghost_free);
+	for(i=0; i<A1OUT_LIMIT; i++)
+		list_push_back(&ghost_free, &ghosts[i].elem);
+	if(!hash_init(&ghost_map, ghost_hash, ghost_less, NULL))
+		PANIC("can't create buffer cache index");
 
+	if(!hash_init(&cache_map, cache_hash, cache_less, NULL))
+		PANIC("can't create buffer cache index");
+
+	// Start with one page; the rest is added as the cache fills up.
+	cache_grow(true);
+}
+
+void cache_init()
+{
 	lock_init(&cache_lock);
+	cond_init(&cache_avail);
+	cache_setup();
+	palloc_set_reclaim(cache_reclaim);
+
+	lock_init(&flush_lock);
+	flush_stopped = false;
+
+	ra_head = ra_cnt = 0;
+	lock_init(&ra_lock);
+	cond_init(&ra_cond);
+	thread_create("cache-ra", PRI_DEFAULT, cache_readahead_daemon, NULL);
 }
 
+/* Hashes a cache entry by the sector it holds. */
+unsigned cache_hash(const struct hash_elem *e, void *aux UNUSED)
+{
+	const struct cache_data *c = hash_entry(e, struct cache_data, hash_elem);
+	return hash_int(c->sector_id);
+}
+
+/* Orders cache entries by the sector they hold. */
+bool cache_less(const struct hash_elem *a, const struct hash_elem *b, void *aux UNUSED)
+{
+	const struct cache_data *ca = hash_entry(a, struct cache_data, hash_elem);
+	const struct cache_data *cb = hash_entry(b, struct cache_data, hash_elem);
+	return ca->sector_id < cb->sector_id;
+}
+
+/* Hashes a ghost by the sector it remembers. */
+static unsigned ghost_hash(const struct hash_elem *e, void *aux UNUSED)
+{
+	return hash_int(hash_entry(e, struct cache_ghost, hash_elem)->sector_id);
+}
+
+/* Orders ghosts by the sector they remember. */
+static bool ghost_less(const struct hash_elem *a, const struct hash_elem *b, void *aux UNUSED)
+{
+	return hash_entry(a, struct cache_ghost, hash_elem)->sector_id
+		< hash_entry(b, struct cache_ghost, hash_elem)->sector_id;
+}
+
+/* Acquires cache_lock, charging any time spent waiting for it to
+   the statistics. */
+static void cache_lock_acquire(void)
+{
+	int64_t start;
+
+	if(lock_try_acquire(&cache_lock)) return;
+	start = timer_ticks();
+	lock_acquire(&cache_lock);
+	stats.lock_waits++;
+	stats.lock_wait_ticks += timer_elapsed(start);
+}
+
+/* Returns the index of the entry holding SECTOR_ID, or -1 if the
+   sector is not cached. */
+static int cache_find(block_sector_t sector_id)
+{
+	struct cache_data key;
+	struct hash_elem *e;
+
+	key.sector_id = sector_id;
+	e = hash_find(&cache_map, &key.hash_elem);
+	if(e == NULL) return -1;
+	return hash_entry(e, struct cache_data, hash_elem) - cache;
+}
+
+/* True if entry CACHE_ID is in the middle of a disk transfer. */
+static bool cache_busy(int cache_id)
+{
+	return cache[cache_id].state == CACHE_LOADING
+		|| cache[cache_id].state == CACHE_WRITING;
+}
+
+/* Sets the type of entry CACHE_ID, keeping meta_cnt up to date. */
+static void cache_set_type(int cache_id, enum cache_type type)
+{
+	if(cache[cache_id].type == CACHE_META) meta_cnt--;
+	cache[cache_id].type = type;
+	if(type == CACHE_META) meta_cnt++;
+}
+
+/* True if eviction should pass over entry CACHE_ID while it has
+   any other choice. */
+static bool cache_spared(int cache_id)
+{
+	return cache[cache_id].type == CACHE_META && meta_cnt <= META_LIMIT;
+}
+
+/* Writes entry CACHE_ID back if it is dirty.  Must be called with
+   cache_lock held and the entry not busy; the lock is dropped for
+   the transfer, so the caller must recheck anything it relies on. */
 void cache_flush_out(int cache_id)
 {
-	if(cache[cache_id].sector_id == -1) return;
-	if(cache[cache_id].dirty == true)
-		block_write(fs_device, cache[cache_id].sector_id, cache[cache_id].addr);
+	struct cache_data *c = &cache[cache_id];
+
+	ASSERT(lock_held_by_current_thread(&cache_lock));
+	if(c->state != CACHE_DIRTY) return;
+
+	c->state = CACHE_WRITING;
+	stats.writebacks++;
+	lock_release(&cache_lock);
+	block_write(fs_device, c->sector_id, c->addr);
+	cache_lock_acquire();
+	c->state = CACHE_VALID;
+	cond_broadcast(&c->io_done, &cache_lock);
+	cond_broadcast(&cache_avail, &cache_lock);
+}
+
+/* Returns the least recently queued entry on QUEUE that is neither
+   pinned nor busy, or -1 if there is none.  Spared metadata is
+   skipped if SPARE_META. */
+static int cache_queue_victim(struct list *queue, bool spare_meta)
+{
+	struct list_elem *e;
+	for(e = list_rbegin(queue); e != list_rend(queue); e = list_prev(e))
+	{
+		int i = list_entry(e, struct cache_data, queue_elem) - cache;
+		if(cache[i].open_cnt > 0 || cache_busy(i)) continue;
+		if(spare_meta && cache_spared(i)) continue;
+		return i;
+	}
+	return -1;
 }
 
-void *cache_evict()
+/* Picks a 2Q victim: from a1in while it holds more than its share,
+   otherwise the least recently used entry of am. */
+static int cache_evict_2q(bool spare_meta)
 {
-	int i_;
-	for(i_ = 0; i_ < CACHE_LIMIT; i_++)
-			if(cache[i_].open_cnt == 0) return i_;
+	int victim = -1;
+	if(a1in_cnt > A1IN_LIMIT)
+		victim = cache_queue_victim(&a1in, spare_meta);
+	if(victim == -1)
+		victim = cache_queue_victim(&am, spare_meta);
+	if(victim == -1)
+		victim = cache_queue_victim(&a1in, spare_meta);
+	return victim;
+}
 
-	// Cache eviction using second chance algorithm.
-	for(i_ = 0; i_ < 2*CACHE_LIMIT; i_++)
+/* Picks a victim by second chance: the first entry the hand finds
+   that has not been accessed since it last came round. */
+static int cache_evict_clock(bool spare_meta)
+{
+	int i_;
+	for(i_ = 0; i_ < 2*cache_capacity; i_++)
 	{
-		int i = i_ % CACHE_LIMIT;
-		if(cache[i].open_cnt > 0) continue;
+		int i = clock_hand;
+		clock_hand = (clock_hand + 1) % cache_capacity;
+		if(cache[i].addr == NULL) continue;
+		if(cache[i].open_cnt > 0 || cache_busy(i)) continue;
+		if(spare_meta && cache_spared(i)) continue;
 		if(cache[i].accessed == true)
 			cache[i].accessed = false;
 		else // Found one to evict.
-		{
-			cache_flush_out(i);
 			return i;
-		}
 	}
 	return -1;
 }
 
-int cache_load(block_sector_t sector_id)
+/* Takes CACHE_ID, which is about to be reused, off its 2Q queue.
+   A sector leaving a1in is remembered on a1out. */
+static void cache_forget(int cache_id)
 {
-	lock_acquire(&cache_lock);
+	struct cache_data *c = &cache[cache_id];
+	if(c->queue == NULL) return;
 
+	list_remove(&c->queue_elem);
+	if(c->queue == &a1in)
+	{
+		struct cache_ghost *g;
+		a1in_cnt--;
+		if(list_empty(&ghost_free))
+		{
+			g = list_entry(list_pop_back(&a1out), struct cache_ghost, elem);
+			hash_delete(&ghost_map, &g->hash_elem);
+		}
+		else
+			g = list_entry(list_pop_front(&ghost_free), struct cache_ghost, elem);
+		g->sector_id = c->sector_id;
+		list_push_front(&a1out, &g->elem);
+		hash_insert(&ghost_map, &g->hash_elem);
+	}
+	c->queue = NULL;
+}
+
+/* Queues CACHE_ID, just given a new sector, for 2Q: on am if the
+   sector was evicted from a1in recently, otherwise on a1in. */
+static void cache_admit(int cache_id)
+{
+	struct cache_data *c = &cache[cache_id];
+	struct cache_ghost key;
+	struct hash_elem *e;
+
+	if(cache_policy != CACHE_2Q) return;
+	key.sector_id = c->sector_id;
+	e = hash_delete(&ghost_map, &key.hash_elem);
+	if(e != NULL)
+	{
+		struct cache_ghost *g = hash_entry(e, struct cache_ghost, hash_elem);
+		list_remove(&g->elem);
+		list_push_front(&ghost_free, &g->elem);
+		c->queue = &am;
+	}
+	else
+	{
+		c->queue = &a1in;
+		a1in_cnt++;
+	}
+	list_push_front(c->queue, &c->queue_elem);
+}
+
+/* Notes a hit on CACHE_ID.  Under 2Q only am is kept in LRU order;
+   a1in stays FIFO so that a burst of hits on a new sector does not
+   make it look hot. */
+static void cache_touch(int cache_id)
+{
+	struct cache_data *c = &cache[cache_id];
+	c->accessed = true;
+	if(c->queue == &am)
+	{
+		list_remove(&c->queue_elem);
+		list_push_front(&am, &c->queue_elem);
+	}
+}
+
+/* Backs one more page of entries and puts them on the free list.
+   Unless FORCE, only does so while the cache is below its capacity
+   and the kernel pool has memory to spare.  Returns true if the
+   cache grew. */
+static bool cache_grow(bool force)
+{
+	int first, i;
+	void *page;
+
+	if(cache_cnt >= cache_capacity) return false;
+	if(!force && palloc_free_cnt(0) * CACHE_RESERVE <= palloc_pool_size(0))
+		return false;
+
+	for(first = 0; cache[first].addr != NULL; first += SECTORS_PER_PAGE)
+		continue;
+	page = palloc_get_page(force ? PAL_ASSERT : 0);
+	if(page == NULL) return false;
+
+	for(i = 0; i < SECTORS_PER_PAGE; i++)
+	{
+		cache[first + i].addr = page + i * BLOCK_SECTOR_SIZE;
+		list_push_back(&cache_free, &cache[first + i].queue_elem);
+	}
+	cache_cnt += SECTORS_PER_PAGE;
+	return true;
+}
+
+/* True if no entry in the page starting at entry FIRST is pinned,
+   busy or dirty, so the page can be handed back without I/O. */
+static bool cache_chunk_idle(int first)
+{
 	int i;
-	for(i=0; i<CACHE_LIMIT; i++)
-		if(cache[i].sector_id == sector_id)
+	for(i = first; i < first + SECTORS_PER_PAGE; i++)
+		if(cache[i].open_cnt > 0
+			|| (cache[i].state != CACHE_FREE && cache[i].state != CACHE_VALID))
+			return false;
+	return true;
+}
+
+/* Called by palloc when the kernel pool runs dry: gives back up to
+   PAGE_CNT pages whose entries are all clean and unpinned, keeping
+   at least one.  Returns true if any page was freed.  Does nothing
+   if cache_lock is not immediately available, since the caller may
+   be inside the cache already.  The caller may also be malloc(),
+   holding its own lock, so the indexes are kept from resizing
+   while entries come out of them. */
+static bool cache_reclaim(size_t page_cnt)
+{
+	size_t freed = 0;
+	int first, i;
+
+	if(lock_held_by_current_thread(&cache_lock) || !lock_try_acquire(&cache_lock))
+		return false;
+
+	hash_set_fixed(&cache_map, true);
+	hash_set_fixed(&ghost_map, true);
+	for(first = cache_capacity - SECTORS_PER_PAGE;
+		first >= 0 && freed < page_cnt && cache_cnt > SECTORS_PER_PAGE;
+		first -= SECTORS_PER_PAGE)
+	{
+		void *page = cache[first].addr;
+		if(page == NULL || !cache_chunk_idle(first)) continue;
+
+		for(i = first; i < first + SECTORS_PER_PAGE; i++)
 		{
-			cache[i].accessed = true;
-			cache[i].open_cnt++;
+			if(cache[i].state == CACHE_FREE)
+				list_remove(&cache[i].queue_elem);
+			else
+			{
+				hash_delete(&cache_map, &cache[i].hash_elem);
+				cache_forget(i);
+			}
+			cache[i].state = CACHE_FREE;
+			cache_set_type(i, CACHE_DATA);
+			cache[i].sector_id = -1;
+			cache[i].addr = NULL;
+		}
+		palloc_free_page(page);
+		cache_cnt -= SECTORS_PER_PAGE;
+		freed++;
+	}
+	hash_set_fixed(&cache_map, false);
+	hash_set_fixed(&ghost_map, false);
+	lock_release(&cache_lock);
+	return freed > 0;
+}
+
+/* Picks an entry to reuse, or returns -1 if every entry is pinned
+   or busy.  The entry returned may still be dirty.  Metadata
+   within its share is only taken when nothing else can be. */
+int cache_evict()
+{
+	int victim;
+
+	// Use an empty entry, growing the cache for one if memory allows.
+	if(!list_empty(&cache_free) || cache_grow(false))
+		return list_entry(list_pop_front(&cache_free), struct cache_data, queue_elem) - cache;
+
+	if(cache_policy == CACHE_2Q)
+	{
+		victim = cache_evict_2q(true);
+		if(victim == -1) victim = cache_evict_2q(false);
+	}
+	else
+	{
+		victim = cache_evict_clock(true);
+		if(victim == -1) victim = cache_evict_clock(false);
+	}
+	return victim;
+}
+
+/* Finds or loads SECTOR_ID and returns its entry, pinned if PIN,
+   in which case the entry takes on TYPE.
+   A sector being loaded or written by another thread is waited
+   for on its own entry; only a miss does disk I/O, and it does it
+   after dropping cache_lock.
+
+   If READ is false a miss does no I/O at all: the entry is left
+   LOADING, so that nobody else sees its stale contents, until the
+   caller fills it and calls cache_release(). */
+static int cache_get(block_sector_t sector_id, bool pin, bool read,
+	enum cache_type type)
+{
+	int cache_id;
+
+	cache_lock_acquire();
+	for(;;)
+	{
+		cache_id = cache_find(sector_id);
+		if(cache_id != -1)
+		{
+			cache[cache_id].open_cnt++;
+			while(cache_busy(cache_id))
+				cond_wait(&cache[cache_id].io_done, &cache_lock);
+			if(pin)
+			{
+				cache_set_type(cache_id, type);
+				cache_touch(cache_id);
+				stats.hits++;
+				if(cache[cache_id].prefetched)
+				{
+					cache[cache_id].prefetched = false;
+					stats.readahead_hits++;
+				}
+			}
+			else if(--cache[cache_id].open_cnt == 0)
+				cond_broadcast(&cache_avail, &cache_lock);
 			lock_release(&cache_lock);
-			return i;
+			return cache_id;
+		}
+
+		cache_id = cache_evict();
+		if(cache_id == -1)
+		{
+			cond_wait(&cache_avail, &cache_lock);
+			continue;
 		}
+		if(cache[cache_id].state == CACHE_DIRTY)
+		{
+			// Clean the victim, then look again: while the lock was
+			// dropped it may have been pinned, or our sector loaded.
+			cache_flush_out(cache_id);
+			continue;
+		}
+		break;
+	}
 
-	int cache_id = cache_evict();
-	cache[cache_id].sector_id = sector_id;
-	cache[cache_id].accessed = false;
-	cache[cache_id].dirty = false;
-	cache[i].open_cnt++;
-	block_read (fs_device, sector_id, cache[cache_id].addr);
+	struct cache_data *c = &cache[cache_id];
+	if(c->state != CACHE_FREE)
+	{
+		hash_delete(&cache_map, &c->hash_elem);
+		cache_forget(cache_id);
+		stats.evictions++;
+	}
+	c->sector_id = sector_id;
+	c->state = CACHE_LOADING;
+	cache_set_type(cache_id, type);
+	c->accessed = false;
+	c->prefetched = !pin;
+	c->open_cnt = pin ? 1 : 0;
+	hash_insert(&cache_map, &c->hash_elem);
+	cache_admit(cache_id);
+	if(pin) stats.misses++;
+	lock_release(&cache_lock);
+	if(!read) return cache_id;
+
+	block_read(fs_device, sector_id, c->addr);
+
+	cache_lock_acquire();
+	c->state = CACHE_VALID;
+	cond_broadcast(&c->io_done, &cache_lock);
+	if(!pin) cond_broadcast(&cache_avail, &cache_lock);
 	lock_release(&cache_lock);
 	return cache_id;
 }
 
+/* Returns the entry holding SECTOR_ID, reading it in if needed.
+   The entry is pinned until the caller calls cache_release(). */
+int cache_load(block_sector_t sector_id, enum cache_type type)
+{
+	return cache_get(sector_id, true, true, type);
+}
+
+/* Returns a pinned entry for SECTOR_ID, which the caller is going
+   to overwrite completely, without reading the sector from disk.
+   The caller must fill all BLOCK_SECTOR_SIZE bytes and then call
+   cache_release() with DIRTY true. */
+int cache_claim(block_sector_t sector_id, enum cache_type type)
+{
+	return cache_get(sector_id, true, false, type);
+}
+
+/* Unpins CACHE_ID, marking it dirty if the caller modified it. */
+void cache_release(int cache_id, bool dirty)
+{
+	cache_lock_acquire();
+	ASSERT(cache[cache_id].open_cnt > 0);
+	if(cache[cache_id].state == CACHE_LOADING)
+	{
+		// Filled in by the thread that claimed it.
+		ASSERT(dirty);
+		cond_broadcast(&cache[cache_id].io_done, &cache_lock);
+	}
+	if(dirty) cache[cache_id].state = CACHE_DIRTY;
+	if(--cache[cache_id].open_cnt == 0)
+		cond_broadcast(&cache_avail, &cache_lock);
+	lock_release(&cache_lock);
+}
+
+/* Empties clean, unpinned entry CACHE_ID and puts it on the free
+   list. */
+static void cache_drop(int cache_id)
+{
+	struct cache_data *c = &cache[cache_id];
+
+	ASSERT(c->open_cnt == 0 && c->state == CACHE_VALID);
+	hash_delete(&cache_map, &c->hash_elem);
+	cache_forget(cache_id);
+	c->state = CACHE_FREE;
+	cache_set_type(cache_id, CACHE_DATA);
+	c->sector_id = -1;
+	c->prefetched = false;
+	list_push_back(&cache_free, &c->queue_elem);
+}
+
+/* Pins the entry holding SECTOR_ID once it is not busy, or returns
+   -1 without loading anything if the sector is not cached. */
+static int cache_peek(block_sector_t sector_id)
+{
+	int cache_id;
+
+	cache_lock_acquire();
+	cache_id = cache_find(sector_id);
+	if(cache_id != -1)
+	{
+		cache[cache_id].open_cnt++;
+		while(cache_busy(cache_id))
+			cond_wait(&cache[cache_id].io_done, &cache_lock);
+	}
+	lock_release(&cache_lock);
+	return cache_id;
+}
+
+/* Reads the CNT sectors from SECTOR_ID on into BUFFER without
+   bringing them into the cache.  Cached copies, which may be newer
+   than the disk, are used where there are any; each stretch of
+   sectors in between is read from disk in one transfer. */
+void cache_read_direct(block_sector_t sector_id, size_t cnt, void *buffer)
+{
+	uint8_t *p = buffer;
+
+	while(cnt > 0)
+	{
+		int ids[DIRECT_RUN_MAX];
+		size_t n = cnt < DIRECT_RUN_MAX ? cnt : DIRECT_RUN_MAX;
+		size_t i, j;
+
+		for(i=0; i<n; i++)
+			ids[i] = cache_peek(sector_id + i);
+		for(i=0; i<n; i=j)
+		{
+			if(ids[i] != -1)
+			{
+				memcpy(p + i * BLOCK_SECTOR_SIZE, cache[ids[i]].addr,
+					BLOCK_SECTOR_SIZE);
+				cache_release(ids[i], false);
+				j = i + 1;
+				continue;
+			}
+			for(j=i+1; j<n && ids[j] == -1; j++)
+				continue;
+			block_read_run(fs_device, sector_id + i, j - i,
+				p + i * BLOCK_SECTOR_SIZE);
+		}
+		sector_id += n;
+		p += n * BLOCK_SECTOR_SIZE;
+		cnt -= n;
+	}
+}
+
+/* Writes the CNT sectors in BUFFER to disk from SECTOR_ID on, in
+   one transfer, without bringing them into the cache.  Cached
+   copies are updated too, and since the disk now matches them,
+   they are no longer dirty. */
+void cache_write_direct(block_sector_t sector_id, size_t cnt,
+	const void *buffer)
+{
+	const uint8_t *p = buffer;
+
+	while(cnt > 0)
+	{
+		int ids[DIRECT_RUN_MAX];
+		size_t n = cnt < DIRECT_RUN_MAX ? cnt : DIRECT_RUN_MAX;
+		size_t i;
+
+		// The copies stay pinned until the disk has the data, so
+		// that write-behind cannot put older contents over it.
+		for(i=0; i<n; i++)
+		{
+			ids[i] = cache_peek(sector_id + i);
+			if(ids[i] != -1)
+				memcpy(cache[ids[i]].addr, p + i * BLOCK_SECTOR_SIZE,
+					BLOCK_SECTOR_SIZE);
+		}
+		block_write_run(fs_device, sector_id, n, p);
+
+		cache_lock_acquire();
+		for(i=0; i<n; i++)
+		{
+			int cache_id = ids[i];
+			if(cache_id != -1)
+			{
+				// Unless someone else has the entry pinned and may
+				// have changed it meanwhile.
+				if(cache[cache_id].open_cnt == 1)
+					cache[cache_id].state = CACHE_VALID;
+				continue;
+			}
+
+			// The read-ahead thread may have read the old contents
+			// in while the write was under way.  Throw that copy
+			// away.
+			cache_id = cache_find(sector_id + i);
+			if(cache_id != -1)
+			{
+				cache[cache_id].open_cnt++;
+				while(cache_busy(cache_id))
+					cond_wait(&cache[cache_id].io_done, &cache_lock);
+				if(--cache[cache_id].open_cnt == 0
+					&& cache[cache_id].state == CACHE_VALID)
+					cache_drop(cache_id);
+				cond_broadcast(&cache_avail, &cache_lock);
+			}
+		}
+		lock_release(&cache_lock);
+		for(i=0; i<n; i++)
+			if(ids[i] != -1)
+				cache_release(ids[i], false);
+
+		sector_id += n;
+		p += n * BLOCK_SECTOR_SIZE;
+		cnt -= n;
+	}
+}
+
 void cache_flush_all()
 {
-	lock_acquire(&cache_lock);
+	cache_lock_acquire();
+	int i;
+	for(i=0; i<cache_capacity; i++)
+	{
+		while(cache_busy(i))
+			cond_wait(&cache[i].io_done, &cache_lock);
+		cache_flush_out(i);
+	}
+	lock_release(&cache_lock);
+}
+
+/* Asks the read-ahead thread to bring SECTOR_ID into the cache,
+   without waiting for it. */
+void cache_readahead(block_sector_t sector_id)
+{
+	lock_acquire(&ra_lock);
+	if(ra_cnt < READAHEAD_QUEUE)
+	{
+		ra_queue[(ra_head + ra_cnt) % READAHEAD_QUEUE] = sector_id;
+		ra_cnt++;
+		cond_signal(&ra_cond, &ra_lock);
+	}
+	lock_release(&ra_lock);
+}
+
+/* Read-ahead thread: loads queued sectors one by one.  They are
+   left unpinned and not marked accessed, so they are the first to
+   go if nobody reads them. */
+static void cache_readahead_daemon(void *aux UNUSED)
+{
+	for(;;)
+	{
+		block_sector_t sector_id;
+
+		lock_acquire(&ra_lock);
+		while(ra_cnt == 0)
+			cond_wait(&ra_cond, &ra_lock);
+		sector_id = ra_queue[ra_head];
+		ra_head = (ra_head + 1) % READAHEAD_QUEUE;
+		ra_cnt--;
+		lock_release(&ra_lock);
+
+		cache_get(sector_id, false, true, CACHE_DATA);
+	}
+}
+
+/* Orders cache entry indexes by the sector each one holds. */
+static int cache_sector_cmp(const void *a_, const void *b_)
+{
+	block_sector_t a = cache[*(const int *) a_].sector_id;
+	block_sector_t b = cache[*(const int *) b_].sector_id;
+	return a < b ? -1 : a > b;
+}
+
+/* Writes every dirty sector back to disk in ascending sector order,
+   so the disk head sweeps once across the platter.  Entries that
+   are pinned are left for the next pass, since their owner may be
+   changing them; other threads can use the cache while each sector
+   is being written. */
+static void cache_write_behind(void)
+{
+	int *dirty = flush_order;
+	block_sector_t *sector = flush_sector;
+	int dirty_cnt = 0;
+	int i;
+
+	cache_lock_acquire();
+	for(i=0; i<cache_capacity; i++)
+		if(cache[i].state == CACHE_DIRTY) dirty[dirty_cnt++] = i;
+	qsort(dirty, dirty_cnt, sizeof *dirty, cache_sector_cmp);
+	for(i=0; i<dirty_cnt; i++) sector[i] = cache[dirty[i]].sector_id;
+
+	for(i=0; i<dirty_cnt; i++)
+	{
+		struct cache_data *c = &cache[dirty[i]];
+		if(c->sector_id == sector[i] && c->open_cnt == 0)
+			cache_flush_out(dirty[i]);
+	}
+	lock_release(&cache_lock);
+}
+
+/* Write-behind thread: every cache_flush_interval milliseconds,
+   gives delayed blocks their sectors and pushes dirty sectors to
+   disk, so that eviction rarely has to and a crash loses at most
+   one interval of writes. */
+void cache_flush_daemon(void *aux UNUSED)
+{
+	for(;;)
+	{
+		timer_msleep(cache_flush_interval);
+		lock_acquire(&flush_lock);
+		if(flush_stopped)
+			break;
+		inode_commit_all();
+		cache_write_behind();
+		lock_release(&flush_lock);
+	}
+	lock_release(&flush_lock);
+}
+
+/* Empties the cache and sets it up again with room for CAPACITY
+   sectors, for benchmarks that compare cache sizes.  Dirty sectors
+   are written back first.  The caller must not have any entry
+   pinned, and nothing but the cache's own threads may be using it
+   meanwhile; a write-behind pass in progress is waited for, and so
+   is a read-ahead in progress. */
+void cache_resize(int capacity)
+{
 	int i;
-	for(i=0; i<CACHE_LIMIT; i++) cache_flush_out(i);
+
+	lock_acquire(&flush_lock);
+	cache_lock_acquire();
+	for(;;)
+	{
+		// Everything must be idle at once, without the lock having
+		// been dropped, before the entries can go.
+		for(i=0; i<cache_capacity; i++)
+			if(cache[i].open_cnt > 0
+				|| (cache[i].state != CACHE_FREE && cache[i].state != CACHE_VALID))
+				break;
+		if(i == cache_capacity)
+			break;
+		if(cache_busy(i))
+			cond_wait(&cache[i].io_done, &cache_lock);
+		else if(cache[i].open_cnt > 0)
+			cond_wait(&cache_avail, &cache_lock);
+		else
+			cache_flush_out(i);
+	}
+
+	hash_destroy(&cache_map, NULL);
+	hash_destroy(&ghost_map, NULL);
+	for(i=0; i<cache_capacity; i+=SECTORS_PER_PAGE)
+		if(cache[i].addr != NULL)
+			palloc_free_page(cache[i].addr);
+	free(cache);
+	free(ghosts);
+	free(flush_order);
+	free(flush_sector);
+
+	cache_capacity = capacity;
+	cache_percent = 0;
+	cache_setup();
 	lock_release(&cache_lock);
-}
\ No newline at end of file
+	lock_release(&flush_lock);
+}
+
+/* Stops the write-behind thread, for shutdown.  Waits for a pass
+   in progress to finish; the thread exits when it next wakes up,
+   without touching the file system. */
+void cache_flush_stop(void)
+{
+	lock_acquire(&flush_lock);
+	flush_stopped = true;
+	lock_release(&flush_lock);
+}
+
+/* Copies the cache counters into *OUT. */
+void cache_get_stats(struct cache_stats *out)
+{
+	cache_lock_acquire();
+	*out = stats;
+	lock_release(&cache_lock);
+}
+
+/* Prints buffer cache statistics. */
+void cache_print_stats(void)
+{
+	// Nothing to report if we are powering off before the file
+	// system was set up.
+	if(fs_device == NULL || cache == NULL)
+		return;
+	printf("Cache on %s: %s policy, %d of %d sectors (%d metadata)\n",
+		block_name(fs_device), cache_policy == CACHE_2Q ? "2q" : "clock",
+		cache_cnt, cache_capacity, meta_cnt);
+	printf("Cache: %lld hits (%lld read ahead), %lld misses, %lld evictions, %lld writebacks\n",
+		stats.hits, stats.readahead_hits, stats.misses, stats.evictions,
+		stats.writebacks);
+	printf("Cache: lock contended %lld times, %lld ticks waited\n",
+		stats.lock_waits, stats.lock_wait_ticks);
+}
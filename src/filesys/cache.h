@@ -1,25 +1,95 @@
 #ifndef FILESYS_CACHE_H
 #define FILESYS_CACHE_H
 
+#include <cache-stats.h>
+#include <hash.h>
 #include "devices/block.h"
 #include "threads/synch.h"
+/* Default cache capacity, in sectors. */
 #define CACHE_LIMIT 64
 
+/* Most entries the cache may grow to.  Defaults to CACHE_LIMIT;
+   set with kernel command-line option "-cache-size", or as a
+   percentage of the kernel pool with "-cache-pct". */
+extern int cache_capacity;
+extern int cache_percent;
+
+/* Most sectors a single read-ahead request may ask for. */
+#define READAHEAD_MAX 32
+
+/* Default milliseconds between write-behind passes. */
+#define CACHE_FLUSH_INTERVAL 1000
+
+/* Milliseconds between write-behind passes.
+   Controlled by kernel command-line option "-wb". */
+extern int cache_flush_interval;
+
+/* Replacement policies.
+   Controlled by kernel command-line option "-cache". */
+enum cache_policy
+{
+	CACHE_CLOCK,							/* Second chance over all entries. */
+	CACHE_2Q								/* 2Q: scan-resistant. */
+};
+extern enum cache_policy cache_policy;
+
+/* Life cycle of a cache entry.  Disk transfers happen in the
+   LOADING and WRITING states without cache_lock held; anyone who
+   wants the entry meanwhile waits on its io_done condition. */
+enum cache_state
+{
+	CACHE_FREE,								/* Holds no sector. */
+	CACHE_LOADING,							/* Being read from disk. */
+	CACHE_VALID,							/* Same as the copy on disk. */
+	CACHE_DIRTY,							/* Newer than the copy on disk. */
+	CACHE_WRITING							/* Being written back to disk. */
+};
+
+/* What a cached sector holds.  Metadata (inodes, indirect blocks,
+   directories and the free map) is kept in preference to file
+   data, up to a share of the cache, so that a long data stream
+   does not make every lookup go back to disk. */
+enum cache_type
+{
+	CACHE_DATA,								/* File contents. */
+	CACHE_META								/* File system structure. */
+};
+
 struct cache_data
 {
-	void *addr;								/* Physical address of the cached sector. */
+	void *addr;								/* Sector buffer, null while unbacked. */
+	enum cache_state state;
+	enum cache_type type;					/* As of the last time it was pinned. */
 	bool accessed;
-	bool dirty;
-	int open_cnt;
+	bool prefetched;						/* Read ahead and not yet used. */
+	int open_cnt;							/* Pins; a pinned entry is never evicted. */
 	block_sector_t sector_id;				/* Which sector is stored here. */
+	struct condition io_done;				/* Signaled when a transfer finishes. */
+	struct hash_elem hash_elem;				/* Element in cache_map, keyed by sector_id. */
+	struct list_elem queue_elem;			/* Element in a 2Q queue or the free list. */
+	struct list *queue;						/* 2Q queue holding this entry, if any. */
 };
 
-struct cache_data cache[CACHE_LIMIT];
+struct cache_data *cache;
 
 struct lock cache_lock;
 
 void cache_init(void);
-int cache_load(block_sector_t sector_id);
+int cache_load(block_sector_t sector_id, enum cache_type type);
+int cache_claim(block_sector_t sector_id, enum cache_type type);
+void cache_release(int cache_id, bool dirty);
+void cache_read_direct(block_sector_t sector_id, size_t cnt, void *buffer);
+void cache_write_direct(block_sector_t sector_id, size_t cnt,
+	const void *buffer);
 void cache_flush_all(void);
+void cache_readahead(block_sector_t sector_id);
+void cache_flush_daemon(void *aux);
+void cache_flush_stop(void);
+void cache_resize(int capacity);
+void cache_get_stats(struct cache_stats *stats);
+void cache_print_stats(void);
+
+unsigned cache_hash(const struct hash_elem *e, void *aux);
+bool cache_less(const struct hash_elem *a, const struct hash_elem *b, void *aux);
 
-#endif /* filesys/cache.h */
\ No newline at end of file
+#endif /* filesys/cache.h */
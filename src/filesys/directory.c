@@ -1,7 +1,9 @@
 #include "filesys/directory.h"
 #include <stdio.h>
 #include <string.h>
+#include <hash.h>
 #include <list.h>
+#include <round.h>
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
@@ -22,6 +24,23 @@ struct dir_entry
     bool in_use;                        /* In use or free? */
   };
 
+/* A directory starts out as one array of entries, searched in
+   order.  Once an addition would take it past LINEAR_MAX bytes it
+   is rebuilt as a hash table: each sector is a bucket of
+   BUCKET_ENTRIES entries, and an entry goes in the bucket its name
+   hashes to or, if that is full, the next one with a free slot.  A
+   lookup then reads one bucket, or a few, however large the
+   directory grows.
+
+   A removed entry keeps its name, so that only a slot that has
+   never been used ends a search.  The table doubles, which also
+   clears out removed entries, when an addition has to look through
+   more than PROBE_MAX buckets. */
+#define LINEAR_MAX BLOCK_SECTOR_SIZE
+#define BUCKET_ENTRIES (BLOCK_SECTOR_SIZE / sizeof (struct dir_entry))
+#define MIN_BUCKETS 4
+#define PROBE_MAX 2
+
 /* Creates a directory with space for ENTRY_CNT entries in the
    given SECTOR.  Returns true if successful, false on failure. */
 bool
@@ -85,6 +104,180 @@ dir_get_inode (struct dir *dir)
   return dir->inode;
 }
 
+/* Returns the offset of the entry slot after the one at OFS in
+   directory INODE.  In a hashed directory no slot crosses into the
+   next sector. */
+static off_t
+next_slot (struct inode *inode, off_t ofs)
+{
+  ofs += sizeof (struct dir_entry);
+  if (inode_is_hashed (inode)
+      && ofs % BLOCK_SECTOR_SIZE + sizeof (struct dir_entry)
+         > BLOCK_SECTOR_SIZE)
+    ofs = ROUND_UP (ofs, BLOCK_SECTOR_SIZE);
+  return ofs;
+}
+
+/* Returns the number of buckets in hashed directory INODE.  An
+   addition that ran out of disk space while doubling the table
+   may have left the file longer than the table, so this is the
+   largest power of two that fits. */
+static size_t
+bucket_cnt (struct inode *inode)
+{
+  size_t cnt = 1;
+
+  while (cnt * 2 * BLOCK_SECTOR_SIZE <= (size_t) inode_length (inode))
+    cnt *= 2;
+  return cnt;
+}
+
+/* Searches hashed directory INODE for NAME, a bucket at a time
+   from the one NAME hashes to, until a slot that has never been
+   used shows there is no further to look.  Each bucket is read
+   whole and searched in memory.  Returns true and sets *EP and
+   *OFSP as lookup() does if NAME is found.  If FREEP is non-null,
+   sets *FREEP to the offset of the first free slot on the way, or
+   -1 if there was none; if PROBESP is non-null, sets *PROBESP to
+   the number of buckets read. */
+static bool
+hash_lookup (struct inode *inode, const char *name, struct dir_entry *ep,
+             off_t *ofsp, off_t *freep, size_t *probesp)
+{
+  struct dir_entry bucket[BUCKET_ENTRIES];
+  size_t cnt = bucket_cnt (inode);
+  size_t b = hash_string (name) & (cnt - 1);
+  off_t free_ofs = -1;
+  bool found = false, end = false;
+  size_t probes;
+
+  for (probes = 0; probes < cnt && !found && !end; probes++)
+    {
+      off_t ofs = (off_t) b * BLOCK_SECTOR_SIZE;
+      size_t i;
+
+      if (inode_read_at (inode, bucket, sizeof bucket, ofs) != sizeof bucket)
+        break;
+      for (i = 0; i < BUCKET_ENTRIES; i++, ofs += sizeof *bucket)
+        {
+          struct dir_entry *e = &bucket[i];
+
+          if (e->in_use && !strcmp (name, e->name))
+            {
+              if (ep != NULL)
+                *ep = *e;
+              if (ofsp != NULL)
+                *ofsp = ofs;
+              found = true;
+              break;
+            }
+          if (!e->in_use && free_ofs < 0)
+            free_ofs = ofs;
+          if (!e->in_use && e->name[0] == '\0')
+            {
+              end = true;
+              break;
+            }
+        }
+      b = (b + 1) & (cnt - 1);
+    }
+
+  if (freep != NULL)
+    *freep = free_ofs;
+  if (probesp != NULL)
+    *probesp = probes;
+  return found;
+}
+
+/* Rebuilds directory INODE, in whichever format it is now, as a
+   hash table of at least BUCKETS buckets holding the same entries.
+   Every sector of the new table is allocated before anything is
+   moved, so if memory or disk space runs out INODE is left as it
+   was and false is returned. */
+static bool
+rehash (struct inode *inode, size_t buckets)
+{
+  struct dir_entry e, *entries;
+  size_t entry_cnt = 0, i;
+  off_t ofs;
+
+  /* Gather the entries in use. */
+  for (ofs = 0; inode_read_at (inode, &e, sizeof e, ofs) == sizeof e;
+       ofs = next_slot (inode, ofs))
+    if (e.in_use)
+      entry_cnt++;
+  while (buckets * BUCKET_ENTRIES < 2 * entry_cnt
+         || buckets * BLOCK_SECTOR_SIZE < (size_t) inode_length (inode))
+    buckets *= 2;
+  entries = malloc ((entry_cnt + 1) * sizeof *entries);
+  if (entries == NULL)
+    return false;
+  entry_cnt = 0;
+  for (ofs = 0; inode_read_at (inode, &e, sizeof e, ofs) == sizeof e;
+       ofs = next_slot (inode, ofs))
+    if (e.in_use)
+      entries[entry_cnt++] = e;
+
+  if (!inode_allocate (inode, buckets * BLOCK_SECTOR_SIZE))
+    {
+      free (entries);
+      return false;
+    }
+
+  /* Clear the old slots, then put each entry in its bucket. */
+  for (ofs = 0; inode_read_at (inode, &e, sizeof e, ofs) == sizeof e;
+       ofs = next_slot (inode, ofs))
+    if (e.in_use || e.name[0] != '\0')
+      {
+        memset (&e, 0, sizeof e);
+        inode_write_at (inode, &e, sizeof e, ofs);
+      }
+  if (!inode_is_hashed (inode))
+    inode_set_hashed (inode);
+  for (i = 0; i < entry_cnt; i++)
+    {
+      hash_lookup (inode, entries[i].name, NULL, NULL, &ofs, NULL);
+      ASSERT (ofs >= 0);
+      inode_write_at (inode, &entries[i], sizeof entries[i], ofs);
+    }
+  free (entries);
+  return true;
+}
+
+/* Returns the offset of a free slot in DIR for an entry named
+   NAME, converting DIR to a hash table or doubling its table
+   first if that is due.  Returns -1 if the disk is full. */
+static off_t
+free_slot (struct dir *dir, const char *name)
+{
+  struct dir_entry e;
+  size_t probes;
+  off_t ofs;
+
+  if (!inode_is_hashed (dir->inode))
+    {
+      /* inode_read_at() will only return a short read at end of
+         file.  Otherwise, we'd need to verify that we didn't get a
+         short read due to something intermittent such as low
+         memory. */
+      for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+           ofs += sizeof e)
+        if (!e.in_use)
+          return ofs;
+
+      /* Past LINEAR_MAX, switch to a hash table if we can, or else
+         carry on appending. */
+      if (ofs + sizeof e <= LINEAR_MAX || !rehash (dir->inode, MIN_BUCKETS))
+        return ofs;
+    }
+
+  hash_lookup (dir->inode, name, NULL, NULL, &ofs, &probes);
+  if ((ofs < 0 || probes > PROBE_MAX)
+      && rehash (dir->inode, bucket_cnt (dir->inode) * 2))
+    hash_lookup (dir->inode, name, NULL, NULL, &ofs, NULL);
+  return ofs;
+}
+
 /* Searches DIR for a file with the given NAME.
    If successful, returns true, sets *EP to the directory entry
    if EP is non-null, and sets *OFSP to the byte offset of the
@@ -100,6 +293,9 @@ lookup (const struct dir *dir, const char *name,
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  if (inode_is_hashed (dir->inode))
+    return hash_lookup (dir->inode, name, ep, ofsp, NULL, NULL);
+
   for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
        ofs += sizeof e) 
   {
@@ -128,10 +324,12 @@ dir_lookup (const struct dir *dir, const char *name,
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  inode_lock_dir (dir->inode);
   if (lookup (dir, name, &e, NULL))
     *inode = inode_open (e.inode_sector);
   else
     *inode = NULL;
+  inode_unlock_dir (dir->inode);
 
   return *inode != NULL;
 }
@@ -156,6 +354,8 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
   if (*name == '\0' || strlen (name) > NAME_MAX)
     return false;
 
+  inode_lock_dir (dir->inode);
+
   /* Check that NAME is not in use. */
   if (lookup (dir, name, NULL, NULL))
     goto done;
@@ -167,15 +367,10 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
 
   /* Set OFS to offset of free slot.
      If there are no free slots, then it will be set to the
-     current end-of-file.
-     
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (!e.in_use)
-      break;
+     current end-of-file. */
+  ofs = free_slot (dir, name);
+  if (ofs < 0)
+    goto done;
 
   /* Write slot. */
   e.in_use = true;
@@ -184,6 +379,7 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
   success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
 
  done:
+  inode_unlock_dir (dir->inode);
   return success;
 }
 
@@ -192,7 +388,7 @@ bool dir_is_empty (struct inode *inode)
   struct dir_entry e;
   off_t pos;
 
-  for(pos=0; inode_read_at (inode, &e, sizeof e, pos) == sizeof e; pos += sizeof e)
+  for(pos=0; inode_read_at (inode, &e, sizeof e, pos) == sizeof e; pos = next_slot (inode, pos))
     if (e.in_use) return false;
   return true;
 }
@@ -204,29 +400,37 @@ bool
 dir_remove (struct dir *dir, const char *name) 
 {
   struct dir_entry e;
+  struct inode *inode = NULL;
+  bool child_locked = false;
   bool success = false;
   off_t ofs;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  inode_lock_dir (dir->inode);
+
   /* Find directory entry. */
   if (!lookup (dir, name, &e, &ofs))
     goto done;
 
   /* Open inode. */
-  struct inode *inode = inode_open (e.inode_sector);
+  inode = inode_open (e.inode_sector);
   if (inode == NULL)
     goto done;
 
   if(inode_get_inumber(inode) == ROOT_DIR_SECTOR)
     goto done;
 
-  if(inode_isdir(inode) && inode_get_open_cnt(inode) > 1)
-    goto done;
-
-  if(inode_isdir(inode) && !dir_is_empty(inode))
-    goto done;
+  /* Keep entries from being added to a directory while we decide
+     whether it is empty. */
+  if(inode_isdir(inode))
+  {
+    inode_lock_dir(inode);
+    child_locked = true;
+    if(inode_get_open_cnt(inode) > 1 || !dir_is_empty(inode))
+      goto done;
+  }
 
   /* Erase directory entry. */
   e.in_use = false;
@@ -238,37 +442,51 @@ dir_remove (struct dir *dir, const char *name)
   success = true;
 
  done:
+  if (child_locked)
+    inode_unlock_dir (inode);
   inode_close (inode);
+  inode_unlock_dir (dir->inode);
   return success;
 }
 
 /* Reads the next directory entry in DIR and stores the name in
    NAME.  Returns true if successful, false if the directory
-   contains no more entries. */
+   contains no more entries.  Entries added since the last call
+   may move the others around in a hashed directory, so some may
+   then be missed or returned twice. */
 bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 {
   struct dir_entry e;
+  bool found = false;
 
+  inode_lock_dir (dir->inode);
   while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
     {
-      dir->pos += sizeof e;
+      dir->pos = next_slot (dir->inode, dir->pos);
       if (e.in_use)
         {
           strlcpy (name, e.name, NAME_MAX + 1);
-          return true;
+          found = true;
+          break;
         } 
     }
-  return false;
+  inode_unlock_dir (dir->inode);
+  return found;
 }
 
 /* Go up one directory in directory tree. */
 struct dir *dir_go_up(struct dir *dir)
 {
   struct inode *ind = dir_get_inode(dir);
-  dir_close(dir);
-  if(!ind) return NULL;
+  if(!ind)
+  {
+    dir_close(dir);
+    return NULL;
+  }
+  /* Read the parent before closing, which may free the inode. */
   block_sector_t parent_id = inode_get_parent(ind);
+  dir_close(dir);
   ind = inode_open(parent_id);
   if(!ind) return NULL;
   return dir_open(ind);
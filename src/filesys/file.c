@@ -9,6 +9,7 @@ struct file
     struct inode *inode;        /* File's inode. */
     off_t pos;                  /* Current position. */
     bool deny_write;            /* Has file_deny_write() been called? */
+    bool direct;                /* Bypass the buffer cache? */
   };
 
 /* Opens a file for the given INODE, of which it takes ownership,
@@ -23,6 +24,7 @@ file_open (struct inode *inode)
       file->inode = inode;
       file->pos = 0;
       file->deny_write = false;
+      file->direct = false;
       return file;
     }
   else
@@ -68,7 +70,7 @@ file_get_inode (struct file *file)
 off_t
 file_read (struct file *file, void *buffer, off_t size) 
 {
-  off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
+  off_t bytes_read = file_read_at (file, buffer, size, file->pos);
   file->pos += bytes_read;
   return bytes_read;
 }
@@ -81,6 +83,8 @@ file_read (struct file *file, void *buffer, off_t size)
 off_t
 file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs) 
 {
+  if (file->direct)
+    return inode_read_direct (file->inode, buffer, size, file_ofs);
   return inode_read_at (file->inode, buffer, size, file_ofs);
 }
 
@@ -94,7 +98,7 @@ file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs)
 off_t
 file_write (struct file *file, const void *buffer, off_t size) 
 {
-  off_t bytes_written = inode_write_at (file->inode, buffer, size, file->pos);
+  off_t bytes_written = file_write_at (file, buffer, size, file->pos);
   file->pos += bytes_written;
   return bytes_written;
 }
@@ -110,9 +114,22 @@ off_t
 file_write_at (struct file *file, const void *buffer, off_t size,
                off_t file_ofs) 
 {
+  if (file->direct)
+    return inode_write_direct (file->inode, buffer, size, file_ofs);
   return inode_write_at (file->inode, buffer, size, file_ofs);
 }
 
+/* Makes reads and writes through FILE bypass the buffer cache for
+   whole sectors if DIRECT is true, or go through it if false.
+   Meant for large streaming transfers that would only evict more
+   useful sectors from the cache. */
+void
+file_set_direct (struct file *file, bool direct)
+{
+  ASSERT (file != NULL);
+  file->direct = direct;
+}
+
 /* Prevents write operations on FILE's underlying inode
    until file_allow_write() is called or FILE is closed. */
 void
@@ -1,6 +1,7 @@
 #ifndef FILESYS_FILE_H
 #define FILESYS_FILE_H
 
+#include <stdbool.h>
 #include "filesys/off_t.h"
 
 struct inode;
@@ -17,6 +18,9 @@ off_t file_read_at (struct file *, void *, off_t size, off_t start);
 off_t file_write (struct file *, const void *, off_t);
 off_t file_write_at (struct file *, const void *, off_t size, off_t start);
 
+/* Bypassing the buffer cache. */
+void file_set_direct (struct file *, bool direct);
+
 /* Preventing writes. */
 void file_deny_write (struct file *);
 void file_allow_write (struct file *);
@@ -12,6 +12,8 @@
 /* Partition that contains the file system. */
 struct block *fs_device;
 
+bool filesys_extents;
+
 static void do_format (void);
 
 /* Initializes the file system module.
@@ -29,8 +31,16 @@ filesys_init (bool format)
 
   if (format) 
     do_format ();
+  else
+    {
+      struct inode *root = inode_open (ROOT_DIR_SECTOR);
+      filesys_extents = inode_has_extents (root);
+      inode_close (root);
+    }
 
   free_map_open ();
+
+  thread_create ("cache-wb", PRI_DEFAULT, cache_flush_daemon, NULL);
 }
 
 /* Shuts down the file system module, writing any unwritten data
@@ -38,6 +48,12 @@ filesys_init (bool format)
 void
 filesys_done (void) 
 {
+  /* Nothing to write if we are powering off before the file
+     system was set up. */
+  if (cache == NULL)
+    return;
+  cache_flush_stop ();
+  inode_commit_all ();
   free_map_close ();
   cache_flush_all();
 }
@@ -90,7 +106,8 @@ filesys_create (const char *name, off_t initial_size, bool is_dir)
   bool success = (dir != NULL
                   && (file_name != NULL || (inode_get_inumber(dir_get_inode(dir))) == ROOT_DIR_SECTOR)
                   && strcmp(file_name, ".") && strcmp(file_name, "..")
-                  && free_map_allocate (1, &inode_sector)
+                  && free_map_allocate_near (free_map_inode_goal (inode_get_inumber (dir_get_inode (dir)), is_dir),
+                                             1, &inode_sector)
                   && inode_create (inode_sector, initial_size, is_dir)
                   && dir_add (dir, file_name, inode_sector));
   if (!success && inode_sector != 0) 
@@ -166,7 +183,7 @@ filesys_remove (const char *name)
 static void
 do_format (void)
 {
-  printf ("Formatting file system...");
+  printf ("Formatting file system%s...", filesys_extents ? " with extents" : "");
   free_map_create ();
   if (!dir_create (ROOT_DIR_SECTOR, 16))
     PANIC ("root directory creation failed");
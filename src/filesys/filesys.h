@@ -11,6 +11,12 @@
 /* Block device that contains the file system. */
 struct block *fs_device;
 
+/* Whether new inodes map their data with extent trees instead of
+   sector pointers.  Chosen when formatting, with kernel
+   command-line option "-extents"; otherwise taken from the root
+   directory. */
+extern bool filesys_extents;
+
 void filesys_init (bool format);
 void filesys_done (void);
 bool filesys_create (const char *name, off_t initial_size, bool is_dir);
@@ -1,24 +1,561 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <random.h>
+#include <round.h>
+#include <stdio.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
 
 static int used_bit;
 
+/* Sectors promised to data whose allocation has been delayed.
+   Other allocations leave this many free sectors alone. */
+static size_t reserved_cnt;
+
+/* Sectors of the free map file that are out of date, one bit per
+   sector.  Only these are written back, through the buffer cache,
+   which also merges repeated changes to one sector into a single
+   disk write. */
+static struct bitmap *dirty_sectors;
+
+/* Bits of the free map held by one sector of its file. */
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
+
+/* The disk is divided into allocation groups, each the sectors
+   described by one sector of the free map.  Files are kept in the
+   group of their directory and directories are spread across
+   groups, so that related sectors stay close together. */
+#define GROUP_SECTORS BITS_PER_SECTOR
+static size_t group_cnt;             /* Number of groups. */
+static size_t *group_free;           /* Free sectors in each group. */
+
+/* Serializes allocation and release.  Files grow under their own
+   inode locks, so two of them may allocate at once. */
+static struct lock free_map_lock;
+
+/* In-memory index of the runs of free sectors, kept in step with
+   free_map, so that finding a run of a given length takes time
+   logarithmic in the number of runs rather than linear in the size
+   of the disk.
+
+   Each run is in two treaps (Aragon and Seidel, "Randomized Search
+   Trees"): one ordered by start sector, for finding a run's
+   neighbours and the runs after a goal, and one ordered by length,
+   for best fit.  Nodes in the start tree also record the longest
+   run in their subtree, so that the first run long enough after a
+   goal is found without visiting the runs in between.
+
+   If memory for a node cannot be had, the index is dropped and
+   allocation goes back to scanning the bitmap. */
+enum run_tree
+  {
+    BY_START,                        /* Ordered by start. */
+    BY_LENGTH,                       /* Ordered by length, then start. */
+    RUN_TREE_CNT
+  };
+
+struct free_run
+  {
+    size_t start;                    /* First free sector. */
+    size_t length;                   /* Number of free sectors. */
+    size_t max_length;               /* Longest run in BY_START subtree. */
+    unsigned long priority;          /* Heap order, the same in both trees. */
+    struct free_run *child[RUN_TREE_CNT][2];  /* Left and right children. */
+  };
+
+static struct free_run *run_root[RUN_TREE_CNT];
+static bool runs_valid;              /* False if the index was dropped. */
+static size_t run_cnt;               /* Runs in the index. */
+
+/* Recomputes the free sectors in each group from the free map. */
+static void
+count_groups (void)
+{
+  size_t size = bitmap_size (free_map);
+  size_t i;
+
+  for (i = 0; i < group_cnt; i++)
+    {
+      size_t start = i * GROUP_SECTORS;
+      size_t cnt = size - start < GROUP_SECTORS ? size - start : GROUP_SECTORS;
+      group_free[i] = bitmap_count (free_map, start, cnt, false);
+    }
+}
+
+/* True if run A goes before run B in TREE. */
+static bool
+run_less (enum run_tree tree, const struct free_run *a,
+          const struct free_run *b)
+{
+  if (tree == BY_LENGTH && a->length != b->length)
+    return a->length < b->length;
+  return a->start < b->start;
+}
+
+/* Recomputes R's max_length from its own length and its children
+   in the start tree. */
+static void
+run_update (struct free_run *r)
+{
+  int i;
+
+  r->max_length = r->length;
+  for (i = 0; i < 2; i++)
+    {
+      struct free_run *c = r->child[BY_START][i];
+      if (c != NULL && c->max_length > r->max_length)
+        r->max_length = c->max_length;
+    }
+}
+
+/* Rotates child DIR of *P, 0 for left and 1 for right, into *P's
+   place in TREE. */
+static void
+run_rotate (enum run_tree tree, struct free_run **p, int dir)
+{
+  struct free_run *r = *p;
+  struct free_run *c = r->child[tree][dir];
+
+  r->child[tree][dir] = c->child[tree][!dir];
+  c->child[tree][!dir] = r;
+  *p = c;
+  if (tree == BY_START)
+    {
+      run_update (r);
+      run_update (c);
+    }
+}
+
+/* Inserts R into the subtree of TREE rooted at *P. */
+static void
+run_insert (enum run_tree tree, struct free_run **p, struct free_run *r)
+{
+  int dir;
+
+  if (*p == NULL)
+    {
+      r->child[tree][0] = r->child[tree][1] = NULL;
+      if (tree == BY_START)
+        run_update (r);
+      *p = r;
+      return;
+    }
+  dir = !run_less (tree, r, *p);
+  run_insert (tree, &(*p)->child[tree][dir], r);
+  if ((*p)->child[tree][dir]->priority > (*p)->priority)
+    run_rotate (tree, p, dir);
+  else if (tree == BY_START)
+    run_update (*p);
+}
+
+/* Removes R from the subtree of TREE rooted at *P, which must
+   contain it. */
+static void
+run_remove (enum run_tree tree, struct free_run **p, struct free_run *r)
+{
+  ASSERT (*p != NULL);
+  if (*p != r)
+    run_remove (tree, &(*p)->child[tree][!run_less (tree, r, *p)], r);
+  else if (r->child[tree][0] == NULL)
+    *p = r->child[tree][1];
+  else if (r->child[tree][1] == NULL)
+    *p = r->child[tree][0];
+  else
+    {
+      /* Rotate R down below its higher priority child. */
+      int dir = r->child[tree][1]->priority > r->child[tree][0]->priority;
+      run_rotate (tree, p, dir);
+      run_remove (tree, &(*p)->child[tree][!dir], r);
+    }
+  if (*p != NULL && tree == BY_START)
+    run_update (*p);
+}
+
+/* Adds R to both trees. */
+static void
+run_add (struct free_run *r)
+{
+  run_insert (BY_START, &run_root[BY_START], r);
+  run_insert (BY_LENGTH, &run_root[BY_LENGTH], r);
+  run_cnt++;
+}
+
+/* Removes R from both trees. */
+static void
+run_del (struct free_run *r)
+{
+  run_remove (BY_START, &run_root[BY_START], r);
+  run_remove (BY_LENGTH, &run_root[BY_LENGTH], r);
+  run_cnt--;
+}
+
+/* Returns a new run of LENGTH sectors from START, not yet in the
+   index, or a null pointer if memory is short. */
+static struct free_run *
+run_create (size_t start, size_t length)
+{
+  struct free_run *r = malloc (sizeof *r);
+  if (r != NULL)
+    {
+      r->start = start;
+      r->length = length;
+      r->priority = random_ulong ();
+    }
+  return r;
+}
+
+/* Returns the run that starts last at or before SECTOR, or a null
+   pointer if there is none. */
+static struct free_run *
+run_floor (size_t sector)
+{
+  struct free_run *r = run_root[BY_START], *floor = NULL;
+
+  while (r != NULL)
+    if (r->start <= sector)
+      {
+        floor = r;
+        r = r->child[BY_START][1];
+      }
+    else
+      r = r->child[BY_START][0];
+  return floor;
+}
+
+/* Returns the first run in the subtree of the start tree rooted at
+   R that starts at or after GOAL and is at least CNT sectors long,
+   or a null pointer if there is none. */
+static struct free_run *
+run_first_fit (struct free_run *r, size_t goal, size_t cnt)
+{
+  if (r == NULL || r->max_length < cnt)
+    return NULL;
+  if (r->start >= goal)
+    {
+      struct free_run *left = run_first_fit (r->child[BY_START][0], goal, cnt);
+      if (left != NULL)
+        return left;
+      if (r->length >= cnt)
+        return r;
+    }
+  return run_first_fit (r->child[BY_START][1], goal, cnt);
+}
+
+/* Returns the shortest run at least CNT sectors long, the first of
+   them on disk if there are several, or a null pointer if there is
+   none. */
+static struct free_run *
+run_best_fit (size_t cnt)
+{
+  struct free_run *r = run_root[BY_LENGTH], *best = NULL;
+
+  while (r != NULL)
+    if (r->length >= cnt)
+      {
+        best = r;
+        r = r->child[BY_LENGTH][0];
+      }
+    else
+      r = r->child[BY_LENGTH][1];
+  return best;
+}
+
+/* Returns the longest run, or a null pointer if there are none. */
+static struct free_run *
+run_longest (void)
+{
+  struct free_run *r = run_root[BY_LENGTH];
+
+  while (r != NULL && r->child[BY_LENGTH][1] != NULL)
+    r = r->child[BY_LENGTH][1];
+  return r;
+}
+
+/* Frees R and everything below it in the start tree. */
+static void
+run_destroy (struct free_run *r)
+{
+  if (r != NULL)
+    {
+      run_destroy (r->child[BY_START][0]);
+      run_destroy (r->child[BY_START][1]);
+      free (r);
+    }
+}
+
+/* Empties the index and stops using it. */
+static void
+runs_drop (void)
+{
+  run_destroy (run_root[BY_START]);
+  run_root[BY_START] = run_root[BY_LENGTH] = NULL;
+  run_cnt = 0;
+  runs_valid = false;
+}
+
+/* Rebuilds the index from the free map. */
+static void
+runs_build (void)
+{
+  size_t size = bitmap_size (free_map);
+  size_t start = 0;
+
+  runs_drop ();
+  runs_valid = true;
+  while ((start = bitmap_scan (free_map, start, 1, false)) != BITMAP_ERROR)
+    {
+      size_t end = bitmap_scan (free_map, start, 1, true);
+      struct free_run *r;
+
+      if (end == BITMAP_ERROR)
+        end = size;
+      r = run_create (start, end - start);
+      if (r == NULL)
+        {
+          runs_drop ();
+          return;
+        }
+      run_add (r);
+      start = end;
+    }
+}
+
+/* Takes sectors START through START + CNT - 1, which must all be
+   free, out of the index. */
+static void
+runs_take (size_t start, size_t cnt)
+{
+  struct free_run *r = run_floor (start);
+  size_t end;
+
+  ASSERT (r != NULL && start + cnt <= r->start + r->length);
+  end = r->start + r->length;
+  run_del (r);
+
+  /* Keep R for what is left before START, if anything. */
+  if (start > r->start)
+    {
+      r->length = start - r->start;
+      run_add (r);
+      r = NULL;
+    }
+
+  /* Then for what is left after, if anything. */
+  if (start + cnt < end)
+    {
+      if (r == NULL)
+        r = run_create (start + cnt, end - (start + cnt));
+      else
+        {
+          r->start = start + cnt;
+          r->length = end - r->start;
+        }
+      if (r == NULL)
+        {
+          runs_drop ();
+          return;
+        }
+      run_add (r);
+      r = NULL;
+    }
+  free (r);
+}
+
+/* Puts sectors START through START + CNT - 1, which have just been
+   freed, into the index, merging them with the runs on either
+   side. */
+static void
+runs_give (size_t start, size_t cnt)
+{
+  struct free_run *prev = run_floor (start);
+  struct free_run *next = run_floor (start + cnt);
+
+  if (prev != NULL && prev->start + prev->length != start)
+    prev = NULL;
+  if (next != NULL && next->start != start + cnt)
+    next = NULL;
+
+  if (prev != NULL)
+    {
+      run_del (prev);
+      prev->length += cnt;
+      if (next != NULL)
+        {
+          run_del (next);
+          prev->length += next->length;
+          free (next);
+        }
+      run_add (prev);
+    }
+  else if (next != NULL)
+    {
+      run_del (next);
+      next->start = start;
+      next->length += cnt;
+      run_add (next);
+    }
+  else
+    {
+      struct free_run *r = run_create (start, cnt);
+      if (r == NULL)
+        runs_drop ();
+      else
+        run_add (r);
+    }
+}
+
 /* Initializes the free map. */
 free_map_init (void) 
 {
   free_map = bitmap_create (block_size (fs_device));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
+  dirty_sectors = bitmap_create (DIV_ROUND_UP (bitmap_file_size (free_map),
+                                               BLOCK_SECTOR_SIZE));
+  group_cnt = DIV_ROUND_UP (bitmap_size (free_map), GROUP_SECTORS);
+  group_free = malloc (sizeof *group_free * group_cnt);
+  if (dirty_sectors == NULL || group_free == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+  count_groups ();
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
   used_bit = 2;
+  group_free[0] -= 2;
+  runs_build ();
+  lock_init (&free_map_lock);
+}
+
+/* Notes that the bits for sectors START through START + CNT - 1
+   have changed. */
+static void
+mark_dirty (size_t start, size_t cnt)
+{
+  size_t first = start / BITS_PER_SECTOR;
+  size_t last = (start + cnt - 1) / BITS_PER_SECTOR;
+
+  bitmap_set_multiple (dirty_sectors, first, last - first + 1, true);
+}
+
+/* Writes the dirty sectors of the free map file.  Must be called
+   with free_map_lock held.  Returns true if successful. */
+static bool
+write_dirty (void)
+{
+  size_t sector = 0;
+
+  if (free_map_file == NULL)
+    return true;
+  while ((sector = bitmap_scan (dirty_sectors, sector, 1, true))
+         != BITMAP_ERROR)
+    {
+      size_t start = sector * BITS_PER_SECTOR;
+      size_t cnt = bitmap_size (free_map) - start;
+
+      if (cnt > BITS_PER_SECTOR)
+        cnt = BITS_PER_SECTOR;
+      if (!bitmap_write_range (free_map, free_map_file, start, cnt))
+        return false;
+      bitmap_reset (dirty_sectors, sector);
+    }
+  return true;
+}
+
+/* Marks sectors START through START + CNT - 1 in use if VALUE is
+   true, free otherwise, keeping the counts in step and noting the
+   sectors of the free map file to write.  Must be called with
+   free_map_lock held. */
+static void
+set_sectors (size_t start, size_t cnt, bool value)
+{
+  size_t pos = start, end = start + cnt;
+
+  bitmap_set_multiple (free_map, start, cnt, value);
+  used_bit += value ? (int) cnt : -(int) cnt;
+  while (pos < end)
+    {
+      size_t group = pos / GROUP_SECTORS;
+      size_t group_end = (group + 1) * GROUP_SECTORS;
+      size_t n = (group_end < end ? group_end : end) - pos;
+
+      if (value)
+        group_free[group] -= n;
+      else
+        group_free[group] += n;
+      pos += n;
+    }
+  mark_dirty (start, cnt);
+  if (runs_valid)
+    {
+      if (value)
+        runs_take (start, cnt);
+      else
+        runs_give (start, cnt);
+    }
+}
+
+/* Returns where to start looking for the sector of a new inode
+   whose parent directory's inode is in sector PARENT.  A file goes
+   after its parent, in the same group if there is room.  A
+   directory goes at the start of the group with the most free
+   sectors, so that directories, and the files later created in
+   them, spread out across the disk rather than crowding its
+   start. */
+block_sector_t
+free_map_inode_goal (block_sector_t parent, bool is_dir)
+{
+  size_t i, best = 0;
+
+  if (!is_dir)
+    return parent;
+  lock_acquire (&free_map_lock);
+  for (i = 1; i < group_cnt; i++)
+    if (group_free[i] > group_free[best])
+      best = i;
+  lock_release (&free_map_lock);
+  return best * GROUP_SECTORS;
+}
+
+/* Returns the first of CNT consecutive free sectors that starts at
+   or after GOAL and before LIMIT, or BITMAP_ERROR if there are none,
+   from the index of free runs. */
+static size_t
+runs_first_fit (size_t goal, size_t cnt, size_t limit)
+{
+  struct free_run *r = run_floor (goal);
+
+  if (r != NULL && r->start + r->length >= goal + cnt)
+    return goal < limit ? goal : BITMAP_ERROR;
+  r = run_first_fit (run_root[BY_START], goal, cnt);
+  return r != NULL && r->start < limit ? r->start : BITMAP_ERROR;
+}
+
+/* Returns the first of CNT consecutive free sectors at or after
+   GOAL, wrapping around to the start of the disk, or BITMAP_ERROR
+   if there are none. */
+static size_t
+scan_from (size_t goal, size_t cnt)
+{
+  size_t sector = BITMAP_ERROR;
+
+  if (runs_valid)
+    {
+      sector = runs_first_fit (goal, cnt, bitmap_size (free_map));
+      if (sector == BITMAP_ERROR && goal > 0)
+        sector = runs_first_fit (0, cnt, bitmap_size (free_map));
+      return sector;
+    }
+  if (goal < bitmap_size (free_map))
+    sector = bitmap_scan (free_map, goal, cnt, false);
+  if (sector == BITMAP_ERROR && goal > 0)
+    sector = bitmap_scan (free_map, 0, cnt, false);
+  return sector;
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
@@ -29,28 +566,235 @@ free_map_init (void)
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  return free_map_allocate_near (0, cnt, sectorp);
+}
+
+/* Like free_map_allocate(), but takes the first free sectors at or
+   after GOAL, wrapping around to the start of the disk if there
+   are none. */
+bool
+free_map_allocate_near (block_sector_t goal, size_t cnt,
+                        block_sector_t *sectorp)
+{
+  block_sector_t sector;
+
+  lock_acquire (&free_map_lock);
+  if (bitmap_size (free_map) - used_bit - reserved_cnt < cnt)
+    sector = BITMAP_ERROR;
+  else
+    sector = scan_from (goal, cnt);
+  if (sector != BITMAP_ERROR)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      set_sectors (sector, cnt, true);
+      if (!write_dirty ())
+        {
+          set_sectors (sector, cnt, false);
+          sector = BITMAP_ERROR;
+        }
     }
   if (sector != BITMAP_ERROR)
     *sectorp = sector;
-  if(sector != BITMAP_ERROR) used_bit += cnt;
+  lock_release (&free_map_lock);
   return sector != BITMAP_ERROR;
 }
 
+/* Looks at the free runs that start in sectors [FROM, TO), in
+   order, until one of at least CNT sectors turns up, keeping the
+   longest seen so far in *BEST and *BEST_CNT. */
+static void
+find_run (size_t from, size_t to, size_t cnt, size_t *best,
+          size_t *best_cnt)
+{
+  size_t start = from;
+
+  while (*best_cnt < cnt && start < to)
+    {
+      size_t end;
+
+      start = bitmap_scan (free_map, start, 1, false);
+      if (start == BITMAP_ERROR || start >= to)
+        break;
+      end = bitmap_scan (free_map, start, 1, true);
+      if (end == BITMAP_ERROR)
+        end = bitmap_size (free_map);
+      if (end - start > *best_cnt)
+        {
+          *best = start;
+          *best_cnt = end - start;
+        }
+      start = end;
+    }
+}
+
+/* Picks a free run for allocate_run() from the index of free runs:
+   the first of at least CNT sectors at or after GOAL in GOAL's
+   allocation group, otherwise the shortest of at least CNT sectors
+   anywhere, otherwise the longest there is.  Stores its first
+   sector in *BEST and its length in *BEST_CNT, which stays 0 if the
+   disk is full. */
+static void
+runs_pick (size_t goal, size_t cnt, size_t *best, size_t *best_cnt)
+{
+  size_t group_end = (goal / GROUP_SECTORS + 1) * GROUP_SECTORS;
+  struct free_run *r;
+
+  *best = runs_first_fit (goal, cnt, group_end);
+  if (*best != BITMAP_ERROR)
+    {
+      *best_cnt = cnt;
+      return;
+    }
+  r = run_best_fit (cnt);
+  if (r == NULL)
+    r = run_longest ();
+  if (r != NULL)
+    {
+      *best = r->start;
+      *best_cnt = r->length;
+    }
+  else
+    *best = 0;
+}
+
+/* Allocates the first free run of CNT sectors at or after GOAL,
+   wrapping around to the start of the disk, or if there is none
+   the longest free run there is, and stores its first sector into
+   *SECTORP.  While the index of free runs is in use, runs_pick()
+   chooses the run instead.  Only the free map sectors covering the run are
+   written.  If RESERVED, the sectors come out of the reservation
+   made by free_map_reserve(); otherwise reserved sectors are left
+   alone.  Returns the number of sectors allocated, which is 0 if
+   the disk is full or the free map could not be written. */
+static size_t
+allocate_run (size_t cnt, block_sector_t goal, block_sector_t *sectorp,
+              bool reserved)
+{
+  size_t size = bitmap_size (free_map);
+  size_t best = 0, best_cnt = 0;
+
+  lock_acquire (&free_map_lock);
+  ASSERT (!reserved || cnt <= reserved_cnt);
+  if (!reserved && cnt > size - used_bit - reserved_cnt)
+    cnt = size - used_bit - reserved_cnt;
+  if (goal >= size)
+    goal = 0;
+  if (runs_valid)
+    runs_pick (goal, cnt, &best, &best_cnt);
+  else
+    {
+      find_run (goal, size, cnt, &best, &best_cnt);
+      find_run (0, goal, cnt, &best, &best_cnt);
+    }
+  if (best_cnt > cnt)
+    best_cnt = cnt;
+
+  if (best_cnt > 0)
+    {
+      set_sectors (best, best_cnt, true);
+      if (!write_dirty ())
+        {
+          set_sectors (best, best_cnt, false);
+          best_cnt = 0;
+        }
+    }
+  if (best_cnt > 0)
+    {
+      *sectorp = best;
+      if (reserved)
+        reserved_cnt -= best_cnt;
+    }
+  lock_release (&free_map_lock);
+  return best_cnt;
+}
+
+/* Like allocate_run(), leaving reserved sectors alone. */
+size_t
+free_map_allocate_run (size_t cnt, block_sector_t goal,
+                       block_sector_t *sectorp)
+{
+  return allocate_run (cnt, goal, sectorp, false);
+}
+
+/* Like free_map_allocate_run(), but takes the sectors out of a
+   reservation of at least CNT sectors made earlier with
+   free_map_reserve(), which shrinks by the number allocated. */
+size_t
+free_map_allocate_reserved (size_t cnt, block_sector_t goal,
+                            block_sector_t *sectorp)
+{
+  return allocate_run (cnt, goal, sectorp, true);
+}
+
+/* Sets aside CNT free sectors, without choosing which, for data
+   whose sectors will be allocated later.  Returns false if fewer
+   than CNT sectors are free and unreserved. */
+bool
+free_map_reserve (size_t cnt)
+{
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  success = bitmap_size (free_map) - used_bit - reserved_cnt >= cnt;
+  if (success)
+    reserved_cnt += cnt;
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Gives back CNT sectors reserved with free_map_reserve() that
+   will not be needed after all. */
+void
+free_map_unreserve (size_t cnt)
+{
+  lock_acquire (&free_map_lock);
+  ASSERT (cnt <= reserved_cnt);
+  reserved_cnt -= cnt;
+  lock_release (&free_map_lock);
+}
+
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  free_map_release_deferred (sector, cnt);
+  free_map_flush ();
+}
+
+/* Like free_map_release(), but leaves the free map file to be
+   written by a later free_map_flush(), so that any number of runs
+   can be released for the cost of one write. */
+void
+free_map_release_deferred (block_sector_t sector, size_t cnt)
+{
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
-  used_bit -= cnt;
+  set_sectors (sector, cnt, false);
+  lock_release (&free_map_lock);
+}
+
+/* Like free_map_release(), but puts the sectors back into the
+   reservation they were allocated from with
+   free_map_allocate_reserved(), for sectors that could not be used
+   after all. */
+void
+free_map_release_reserved (block_sector_t sector, size_t cnt)
+{
+  lock_acquire (&free_map_lock);
+  ASSERT (bitmap_all (free_map, sector, cnt));
+  set_sectors (sector, cnt, false);
+  reserved_cnt += cnt;
+  write_dirty ();
+  lock_release (&free_map_lock);
+}
+
+/* Writes the sectors of the free map file changed by releases
+   since they were last written. */
+void
+free_map_flush (void)
+{
+  lock_acquire (&free_map_lock);
+  write_dirty ();
+  lock_release (&free_map_lock);
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -62,13 +806,18 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  used_bit = bitmap_count (free_map, 0, bitmap_size (free_map), true);
+  count_groups ();
+  runs_build ();
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void) 
 {
+  free_map_flush ();
   file_close (free_map_file);
+  free_map_file = NULL;
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -76,19 +825,56 @@ free_map_close (void)
 void
 free_map_create (void) 
 {
+  struct file *file;
+
   /* Create inode. */
   if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map), false))
     PANIC ("free map creation failed");
 
-  /* Write bitmap to file. */
-  free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
-  if (free_map_file == NULL)
+  /* Write bitmap to file.  The new file is all holes, so the first
+     write allocates its sectors; free_map_file is still null then,
+     so that allocating them does not write the free map again.
+     The second write records those sectors as in use. */
+  file = file_open (inode_open (FREE_MAP_SECTOR));
+  if (file == NULL)
     PANIC ("can't open free map");
+  if (!bitmap_write (free_map, file))
+    PANIC ("can't write free map");
+  free_map_file = file;
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
+  bitmap_set_all (dirty_sectors, false);
 }
 
 int free_map_free_space(void)
 {
-  return bitmap_size(free_map) - used_bit;
-}
\ No newline at end of file
+  int free_cnt;
+
+  lock_acquire (&free_map_lock);
+  free_cnt = bitmap_size(free_map) - used_bit - reserved_cnt;
+  lock_release (&free_map_lock);
+  return free_cnt;
+}
+
+/* Prints free space statistics: free sectors and, from the index
+   of free runs, how they are split up. */
+void
+free_map_print_stats (void)
+{
+  struct free_run *longest;
+
+  if (free_map == NULL)
+    return;
+  lock_acquire (&free_map_lock);
+  printf ("Free map: %zu of %zu sectors free, %zu reserved\n",
+          bitmap_size (free_map) - used_bit, bitmap_size (free_map),
+          reserved_cnt);
+  longest = run_longest ();
+  if (!runs_valid)
+    printf ("Free map: run index dropped, out of memory\n");
+  else if (longest != NULL)
+    printf ("Free map: %zu free runs, longest %zu sectors, "
+            "average %zu sectors\n", run_cnt, longest->length,
+            (bitmap_size (free_map) - used_bit) / run_cnt);
+  lock_release (&free_map_lock);
+}
@@ -12,8 +12,21 @@ void free_map_open (void);
 void free_map_close (void);
 
 bool free_map_allocate (size_t, block_sector_t *);
+bool free_map_allocate_near (block_sector_t goal, size_t,
+                             block_sector_t *);
+size_t free_map_allocate_run (size_t, block_sector_t goal,
+                              block_sector_t *);
+size_t free_map_allocate_reserved (size_t, block_sector_t goal,
+                                   block_sector_t *);
+block_sector_t free_map_inode_goal (block_sector_t parent, bool is_dir);
+bool free_map_reserve (size_t);
+void free_map_unreserve (size_t);
 void free_map_release (block_sector_t, size_t);
+void free_map_release_deferred (block_sector_t, size_t);
+void free_map_release_reserved (block_sector_t, size_t);
+void free_map_flush (void);
 
 int free_map_free_space(void);
+void free_map_print_stats (void);
 
 #endif /* filesys/free-map.h */
@@ -1,34 +1,108 @@
 #include "filesys/inode.h"
-#include <list.h>
+#include <hash.h>
 #include <debug.h>
+#include <list.h>
 #include <round.h>
+#include <stdint.h>
 #include <string.h>
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
 #include "filesys/cache.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
-#define MAX_FILE_SIZE 8000000
+/* Identifies an inode whose data is mapped by an extent tree
+   instead of by sector pointers. */
+#define EXTENT_MAGIC 0x494e4f45
 
 #define DIRECT_LIMIT 100
 #define DIRECT_SIZE_LIMIT 51200
 
+/* Pointers to the doubly and triply indirect sectors. */
+#define DOUBLY_PTR DIRECT_LIMIT
+#define TRIPLY_PTR (DIRECT_LIMIT + 1)
+
+/* Bytes mapped by an indirect, doubly indirect and triply indirect
+   sector. */
+#define INDIRECT_SIZE (128 * BLOCK_SECTOR_SIZE)
+#define DOUBLY_SIZE (128 * INDIRECT_SIZE)
+#define TRIPLY_SIZE (128 * DOUBLY_SIZE)
+
+#define MAX_FILE_SIZE (DIRECT_SIZE_LIMIT + DOUBLY_SIZE + TRIPLY_SIZE)
+
+/* Read-ahead window, in sectors, once a reader looks sequential.
+   It doubles on every further sequential read up to
+   READAHEAD_MAX. */
+#define READAHEAD_MIN 2
+
+/* A run of sectors.  In a leaf of an extent tree it maps the
+   LENGTH file sectors from FIRST on to the disk sectors from START
+   on.  In an interior node it points to the child node in sector
+   START, which maps file sectors from FIRST up to the FIRST of the
+   next entry; LENGTH is unused. */
+struct extent
+{
+  uint32_t first;                     /* First file sector. */
+  block_sector_t start;               /* First disk sector, or child. */
+  uint32_t length;                    /* Sectors in the run. */
+};
+
+/* Heads every extent tree node. */
+struct extent_header
+{
+  uint16_t depth;                     /* Levels below; 0 in a leaf. */
+  uint16_t cnt;                       /* Entries in use. */
+};
+
+/* Root of an extent tree, kept in the inode. */
+#define EXTENT_ROOT_CNT 41
+struct extent_root
+{
+  struct extent_header h;
+  struct extent e[EXTENT_ROOT_CNT];   /* Sorted by first. */
+};
+
+/* Any other extent tree node, one sector long. */
+#define EXTENT_NODE_CNT 42
+struct extent_node
+{
+  struct extent_header h;
+  struct extent e[EXTENT_NODE_CNT];   /* Sorted by first. */
+  uint32_t unused;
+};
+
+/* Bits in inode_disk's flags. */
+#define INODE_INLINE 0x01             /* Data is stored in the inode. */
+#define INODE_HASHED 0x02             /* Directory entries are hashed. */
+
+/* Largest file whose data may be kept in its inode. */
+#define INLINE_MAX 496
+
 /* On-disk inode.
    Must be exactly BLOCK_SECTOR_SIZE bytes long. */
 struct inode_disk
 {
   off_t length;                       /* File size in bytes. */
   bool is_dir;
+  uint8_t flags;                      /* INODE_* bits. */
   block_sector_t parent;
-  unsigned magic;                     /* Magic number. */
-  /* The rest will be pointers to data:
-  [0 -> DIRECT_LIMIT) : direct data.
-  DIRECT_LIMIT : doubly indirect data.
-  rest: unused. */
-  int ptr[128-4];
+  unsigned magic;                     /* INODE_MAGIC or EXTENT_MAGIC. */
+  union
+  {
+    /* INODE_MAGIC: pointers to data:
+    [0 -> DIRECT_LIMIT) : direct data.
+    DOUBLY_PTR : doubly indirect data.
+    TRIPLY_PTR : triply indirect data.
+    rest: unused. */
+    int ptr[128-4];
+    /* EXTENT_MAGIC: root of the extent tree. */
+    struct extent_root root;
+    /* INODE_INLINE: the data itself. */
+    uint8_t inline_data[INLINE_MAX];
+  };
 };
 
 struct indirect_sector
@@ -36,6 +110,20 @@ struct indirect_sector
   int ptr[128];
 };
 
+/* True if D keeps its data in the inode sector. */
+static inline bool
+is_inline (const struct inode_disk *d)
+{
+  return (d->flags & INODE_INLINE) != 0;
+}
+
+/* True if D maps its data with an extent tree. */
+static inline bool
+has_extents (const struct inode_disk *d)
+{
+  return d->magic == EXTENT_MAGIC;
+}
+
 /* Returns the number of sectors to allocate for an inode SIZE
    bytes long. */
 static inline size_t
@@ -47,184 +135,1145 @@ bytes_to_sectors (off_t size)
 /* In-memory inode. */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in open_inodes. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
+    off_t ra_next;                      /* Where a sequential read goes next. */
+    off_t ra_end;                       /* Read-ahead queued up to here. */
+    int ra_window;                      /* Read-ahead sectors, 0 if random. */
+    struct indirect_sector *index[2];   /* Doubly, triply indirect, or null. */
+    struct rwlock rw;                   /* Shared by readers, held by writers. */
+    struct lock lock;                   /* Guards index, read-ahead, denials. */
+    struct lock dir_lock;               /* Held across directory updates. */
+    struct list delayed;                /* Delayed blocks, in order of pos. */
+    block_sector_t goal;                /* Where to look for new sectors. */
     struct inode_disk data;
   };
 
+/* A block of file data that has been written but not yet given a
+   disk sector.  It stands in for a hole until inode_commit().  The
+   data is allocated on its own: together with the header it would
+   just miss malloc()'s 512-byte blocks and take a 1 kB one. */
+struct delayed_block
+  {
+    struct list_elem elem;              /* Element in inode's delayed list. */
+    off_t pos;                          /* Offset in file, sector aligned. */
+    uint8_t *data;                      /* BLOCK_SECTOR_SIZE bytes. */
+  };
+
+/* Most delayed blocks held by all inodes together.  Each one holds
+   a sector reserved in the free map. */
+#define DELAY_LIMIT 64
+
+static struct lock delay_lock;          /* Protects delayed_cnt. */
+static int delayed_cnt;                 /* Delayed blocks of all inodes. */
+
+static struct delayed_block *delayed_find (struct inode *, off_t pos);
+
+/* Frees delayed block B. */
+static void
+delayed_free (struct delayed_block *b)
+{
+  free (b->data);
+  free (b);
+}
+
+/* Reads metadata SECTOR into BUFFER through the buffer cache. */
+static void
+meta_read (block_sector_t sector, void *buffer)
+{
+  int cache_id = cache_load (sector, CACHE_META);
+  memcpy (buffer, cache[cache_id].addr, BLOCK_SECTOR_SIZE);
+  cache_release (cache_id, false);
+}
+
+/* Writes BUFFER to metadata SECTOR through the buffer cache. */
+static void
+meta_write (block_sector_t sector, const void *buffer)
+{
+  int cache_id = cache_claim (sector, CACHE_META);
+  memcpy (cache[cache_id].addr, buffer, BLOCK_SECTOR_SIZE);
+  cache_release (cache_id, true);
+}
+
+/* Returns how INODE's data should be classified in the buffer
+   cache: directories and the free map are metadata. */
+static enum cache_type
+inode_data_type (const struct inode *inode)
+{
+  if (inode->data.is_dir || inode->sector == FREE_MAP_SECTOR)
+    return CACHE_META;
+  return CACHE_DATA;
+}
+
+/* Returns pointer IDX of indirect SECTOR, looked up in place in
+   the buffer cache. */
+static block_sector_t
+indirect_lookup (block_sector_t sector, int idx)
+{
+  int cache_id = cache_load (sector, CACHE_META);
+  block_sector_t ptr = ((struct indirect_sector *) cache[cache_id].addr)->ptr[idx];
+  cache_release (cache_id, false);
+  return ptr;
+}
+
+/* Returns the number of entries of node H/E whose first file
+   sector is at most SECTOR, by binary search. */
+static int
+extent_search (const struct extent_header *h, const struct extent *e,
+               uint32_t sector)
+{
+  int lo = 0, hi = h->cnt;
+  while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      if (e[mid].first <= sector)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return lo;
+}
+
+/* Returns the disk sector that holds file SECTOR of the extent
+   inode D, or 0 if no extent maps it, which makes it a hole.  Each
+   level of the tree is searched in place in the buffer cache. */
+static block_sector_t
+extent_lookup (const struct inode_disk *d, uint32_t sector)
+{
+  const struct extent_header *h = &d->root.h;
+  const struct extent *e = d->root.e;
+  block_sector_t result = 0;
+  int cache_id = -1;
+
+  for (;;)
+    {
+      int pos = extent_search (h, e, sector);
+      const struct extent *x;
+      struct extent_node *child;
+      int child_id;
+
+      if (pos == 0)
+        break;
+      x = &e[pos - 1];
+      if (h->depth == 0)
+        {
+          if (sector - x->first < x->length)
+            result = x->start + (sector - x->first);
+          break;
+        }
+
+      /* Pin the child before letting go of its parent. */
+      child_id = cache_load (x->start, CACHE_META);
+      if (cache_id != -1)
+        cache_release (cache_id, false);
+      cache_id = child_id;
+      child = cache[cache_id].addr;
+      h = &child->h;
+      e = child->e;
+    }
+  if (cache_id != -1)
+    cache_release (cache_id, false);
+  return result;
+}
+
+/* Returns the copy of the top indirect sector under pointer SLOT
+   of INODE that is kept in memory while INODE is open, loading it
+   on first use, or a null pointer if memory is short. */
+static struct indirect_sector *
+index_get (struct inode *inode, int slot)
+{
+  struct indirect_sector **copy = &inode->index[slot - DOUBLY_PTR];
+
+  if (*copy == NULL)
+    {
+      /* Readers share the inode, so only one of them loads the
+         copy, and it is published once filled. */
+      lock_acquire (&inode->lock);
+      if (*copy == NULL)
+        {
+          struct indirect_sector *index = malloc (sizeof *index);
+          if (index != NULL)
+            meta_read (inode->data.ptr[slot], index);
+          *copy = index;
+        }
+      lock_release (&inode->lock);
+    }
+  return *copy;
+}
+
+/* Returns the bytes mapped by each entry of the top indirect
+   sector under pointer SLOT. */
+static off_t
+index_span (int slot)
+{
+  return slot == DOUBLY_PTR ? INDIRECT_SIZE : DOUBLY_SIZE;
+}
+
+/* Returns the data sector for byte POS of the tree of indirect
+   sectors under pointer SLOT of INODE, or 0 for a hole.  The top
+   of the tree is in memory, so this reads one indirect sector
+   from the cache per level below it: one for doubly indirect
+   data, two for triply indirect. */
+static block_sector_t
+index_lookup (struct inode *inode, int slot, off_t pos)
+{
+  struct indirect_sector *top;
+  off_t span = index_span (slot);
+  block_sector_t node;
+
+  if (inode->data.ptr[slot] == 0)
+    return 0;
+  top = index_get (inode, slot);
+  if (top != NULL)
+    node = top->ptr[pos / span];
+  else
+    node = indirect_lookup (inode->data.ptr[slot], pos / span);
+  while (node != 0 && span > BLOCK_SECTOR_SIZE)
+    {
+      pos %= span;
+      span /= 128;
+      node = indirect_lookup (node, pos / span);
+    }
+  return node;
+}
+
+/* Clears every pointer of INODE that maps bytes at or past its
+   length.  Inodes written before new inodes were zeroed on
+   creation may hold garbage there: in the direct pointers past
+   the end, in DOUBLY_PTR and TRIPLY_PTR, and in the indirect
+   sectors past the last one in use.  A zero pointer is a hole, so
+   garbage would otherwise be taken for data sectors once the file
+   grows.  Only the path to the last byte can hold any, since the
+   sectors beyond it are reached through pointers cleared here. */
+static void
+inode_trim (struct inode *inode)
+{
+  struct inode_disk *d = &inode->data;
+  off_t pos, span;
+  block_sector_t node;
+  int slot, i;
+
+  if (d->magic != INODE_MAGIC || is_inline (d))
+    return;
+  for (i = bytes_to_sectors (d->length); i < DIRECT_LIMIT; i++)
+    d->ptr[i] = 0;
+  if (d->length <= DIRECT_SIZE_LIMIT)
+    d->ptr[DOUBLY_PTR] = 0;
+  if (d->length <= DIRECT_SIZE_LIMIT + DOUBLY_SIZE)
+    d->ptr[TRIPLY_PTR] = 0;
+  if (d->length <= DIRECT_SIZE_LIMIT)
+    return;
+
+  pos = d->length - 1 - DIRECT_SIZE_LIMIT;
+  slot = DOUBLY_PTR;
+  if (pos >= DOUBLY_SIZE)
+    {
+      slot = TRIPLY_PTR;
+      pos -= DOUBLY_SIZE;
+    }
+  node = d->ptr[slot];
+  for (span = index_span (slot); node != 0; span /= 128)
+    {
+      int cache_id = cache_load (node, CACHE_META);
+      struct indirect_sector *ind = cache[cache_id].addr;
+      bool dirty = false;
+
+      for (i = pos / span + 1; i < 128; i++)
+        if (ind->ptr[i] != 0)
+          {
+            ind->ptr[i] = 0;
+            dirty = true;
+          }
+      node = span > BLOCK_SECTOR_SIZE ? ind->ptr[pos / span] : 0;
+      cache_release (cache_id, dirty);
+      pos %= span;
+    }
+}
+
 /* Returns the block device sector that contains byte offset POS
    within INODE.
    Returns -1 if INODE does not contain data for a byte at offset
-   POS. */
+   POS, or 0 if POS is in a hole, which reads as zeroes. */
 static block_sector_t
-byte_to_sector (const struct inode *inode, off_t pos) 
+byte_to_sector (struct inode *inode, off_t pos) 
 {
   ASSERT (inode != NULL);
   if(pos >= inode->data.length) return -1;
 
+  if(has_extents(&inode->data))
+    return extent_lookup(&inode->data, pos / BLOCK_SECTOR_SIZE);
+
   // Answer is within direct data.
   if(pos < DIRECT_SIZE_LIMIT)
     return inode->data.ptr[pos / 512];
 
-  // Answer is within doubly indirect data.
+  // Answer is within doubly or triply indirect data.
   pos -= DIRECT_SIZE_LIMIT;
-  struct indirect_sector tmp;
-  // Read doubly indirect sector.
-  block_read(fs_device, inode->data.ptr[DIRECT_LIMIT], &tmp);
-  // Read indirect sector.
-  block_read(fs_device, tmp.ptr[pos/(128 * 512)], &tmp);
-  pos %= (128 * 512);
-  return tmp.ptr[pos / 512];
+  if(pos < DOUBLY_SIZE)
+    return index_lookup(inode, DOUBLY_PTR, pos);
+  return index_lookup(inode, TRIPLY_PTR, pos - DOUBLY_SIZE);
 }
 
-// Estimate how many sectors need to be allocate to expand an inode to given length.
-int estimate_expand(struct inode *ind, int length)
+/* A sector of zeroes, for zeroing sectors on disk directly. */
+static const uint8_t zeros[BLOCK_SECTOR_SIZE];
+
+/* Zeroes newly allocated SECTOR through the cache, without reading
+   its stale contents first. */
+static void
+zero_sector (block_sector_t sector, enum cache_type type)
 {
-  int cur_sector = bytes_to_sectors(ind->data.length);
-  int target_sector = bytes_to_sectors(length);
-  if(cur_sector >= target_sector) return 0;
-
-  // Direct data sectors.
-  int ans = target_sector - cur_sector;
-  if(target_sector <= DIRECT_LIMIT) return ans;
-  
-  if(cur_sector <= DIRECT_LIMIT)
-  {
-    ans++;
-    cur_sector = DIRECT_LIMIT;
-  }
-  int cur_indirect_id = (cur_sector - DIRECT_LIMIT) / 128;
-  int target_indirect_id = (target_sector - DIRECT_LIMIT) / 128;
-  return ans + target_indirect_id - cur_indirect_id;
+  int cache_id = cache_claim (sector, type);
+  memset (cache[cache_id].addr, 0, BLOCK_SECTOR_SIZE);
+  cache_release (cache_id, true);
 }
 
-/* Expand an inode to given length. Allocate on-disk memory as needed.
-   Also update to on-disk inode. Return true if successful. */
-bool inode_expand(struct inode *ind, off_t length)
+/* Inserts X at position POS of node H/E, which must have room. */
+static void
+extent_put (struct extent_header *h, struct extent *e, int pos,
+            struct extent x)
 {
-  if(estimate_expand(ind, length) > free_map_free_space()) return false;
+  memmove (e + pos + 1, e + pos, sizeof *e * (h->cnt - pos));
+  e[pos] = x;
+  h->cnt++;
+}
 
-  int cur_sector = bytes_to_sectors(ind->data.length);
-  int target_sector = bytes_to_sectors(length);
-  ind->data.length = length;
-  if(target_sector <= cur_sector)
-  {
-    block_write(fs_device, ind->sector, &ind->data);
+/* Splits the full extent node NODE to make room for X at position
+   POS.  The upper entries move to a newly allocated node, which is
+   described for NODE's parent in *SIBLING.  When X goes at the end,
+   as it does when a file grows, NODE is left full and the new node
+   gets only X.  The new node is allocated near sector GOAL.
+   Returns false if no sector is free. */
+static bool
+extent_split (struct extent_node *node, int pos, struct extent x,
+              struct extent *sibling, block_sector_t goal)
+{
+  int keep = pos == EXTENT_NODE_CNT ? EXTENT_NODE_CNT : EXTENT_NODE_CNT / 2;
+  struct extent_node *new;
+  block_sector_t sector;
+  int cache_id;
+
+  if (!free_map_allocate_near (goal, 1, &sector))
+    return false;
+  cache_id = cache_claim (sector, CACHE_META);
+  new = cache[cache_id].addr;
+  memset (new, 0, sizeof *new);
+  new->h.depth = node->h.depth;
+  new->h.cnt = node->h.cnt - keep;
+  memcpy (new->e, node->e + keep, sizeof *new->e * new->h.cnt);
+  node->h.cnt = keep;
+
+  if (pos > keep || keep == EXTENT_NODE_CNT)
+    extent_put (&new->h, new->e, pos - keep, x);
+  else
+    extent_put (&node->h, node->e, pos, x);
+
+  sibling->first = new->e[0].first;
+  sibling->start = sector;
+  sibling->length = 0;
+  cache_release (cache_id, true);
+  return true;
+}
+
+/* Adds X, which must not overlap any extent already there, to the
+   subtree under node H/E, which has room for MAX entries.  A run
+   that continues the one before it on disk is merged into it.
+
+   If H/E itself has no room for the entry it needs to add, it is
+   left alone and the entry and its position are returned in *OVER
+   and *OVER_POS for the caller to split H/E; otherwise *OVER_POS is
+   -1.  New nodes are allocated near sector GOAL.  Returns false if
+   a sector for a new node could not be allocated. */
+static bool
+extent_insert (struct extent_header *h, struct extent *e, int max,
+               struct extent x, struct extent *over, int *over_pos,
+               block_sector_t goal)
+{
+  int pos = extent_search (h, e, x.first);
+  struct extent y;
+
+  *over_pos = -1;
+  if (h->depth == 0)
+    {
+      if (pos > 0 && e[pos - 1].first + e[pos - 1].length == x.first
+          && e[pos - 1].start + e[pos - 1].length == x.start)
+        {
+          e[pos - 1].length += x.length;
+          return true;
+        }
+      y = x;
+    }
+  else
+    {
+      struct extent_node *child;
+      struct extent child_over;
+      int cache_id, child_pos;
+      bool success;
+
+      if (pos == 0)
+        {
+          e[0].first = x.first;
+          pos = 1;
+        }
+      cache_id = cache_load (e[pos - 1].start, CACHE_META);
+      child = cache[cache_id].addr;
+      success = extent_insert (&child->h, child->e, EXTENT_NODE_CNT, x,
+                               &child_over, &child_pos, goal);
+      if (success && child_pos != -1)
+        success = extent_split (child, child_pos, child_over, &y, goal);
+      cache_release (cache_id, true);
+      if (!success || child_pos == -1)
+        return success;
+    }
+
+  /* Y goes at POS in this node. */
+  if (h->cnt == max)
+    {
+      *over = y;
+      *over_pos = pos;
+    }
+  else
+    extent_put (h, e, pos, y);
+  return true;
+}
+
+/* Maps the LENGTH file sectors from FIRST on to the disk sectors
+   from START on in the extent inode IND.  When the root in the
+   inode overflows, its entries move down into a new node and the
+   tree grows a level.  Returns false if out of disk space. */
+static bool
+extent_add (struct inode *ind, uint32_t first, block_sector_t start,
+            uint32_t length)
+{
+  struct extent_root *root = &ind->data.root;
+  struct extent x, over;
+  struct extent_node *node;
+  block_sector_t sector;
+  int cache_id, pos;
+
+  x.first = first;
+  x.start = start;
+  x.length = length;
+  if (!extent_insert (&root->h, root->e, EXTENT_ROOT_CNT, x, &over, &pos,
+                      ind->goal))
+    return false;
+  if (pos == -1)
     return true;
-  }
 
-  void *zeroes = malloc(BLOCK_SECTOR_SIZE);
-  memset(zeroes, 0, BLOCK_SECTOR_SIZE);
+  if (!free_map_allocate_near (ind->goal, 1, &sector))
+    return false;
+  cache_id = cache_claim (sector, CACHE_META);
+  node = cache[cache_id].addr;
+  memset (node, 0, sizeof *node);
+  node->h = root->h;
+  memcpy (node->e, root->e, sizeof root->e);
+  extent_put (&node->h, node->e, pos, over);
 
-  // Direct allocation.
-  cur_sector++;
-  for(; cur_sector<=DIRECT_LIMIT; cur_sector++)
-  {
-    free_map_allocate(1, &ind->data.ptr[cur_sector - 1]);
-    block_write(fs_device, ind->data.ptr[cur_sector - 1], zeroes);
-    if(cur_sector == target_sector)
+  root->h.depth++;
+  root->h.cnt = 1;
+  root->e[0].first = node->e[0].first;
+  root->e[0].start = sector;
+  root->e[0].length = 0;
+  cache_release (cache_id, true);
+  return true;
+}
+
+/* Releases every run mapped under node H/E, and the nodes below
+   it, leaving the free map file for the caller to write. */
+static void
+extent_free (const struct extent_header *h, const struct extent *e)
+{
+  int i;
+
+  for (i = 0; i < h->cnt; i++)
+    if (h->depth == 0)
+      free_map_release_deferred (e[i].start, e[i].length);
+    else
       {
-        block_write(fs_device, ind->sector, &ind->data);
-        free(zeroes);
-        return true;
+        int cache_id = cache_load (e[i].start, CACHE_META);
+        struct extent_node *child = cache[cache_id].addr;
+        extent_free (&child->h, child->e);
+        cache_release (cache_id, false);
+        free_map_release_deferred (e[i].start, 1);
       }
-  }
+}
 
-  // Doubly indirect allocation.
-  if(cur_sector == DIRECT_LIMIT + 1)
-    free_map_allocate(1, &ind->data.ptr[DIRECT_LIMIT]);
+/* Releases what the runs mapped under node H/E map from file
+   sector CUT on, and the nodes that leaves empty, and takes it
+   out of H/E, leaving the free map file for the caller to
+   write. */
+static void
+extent_trim (struct extent_header *h, struct extent *e, uint32_t cut)
+{
+  while (h->cnt > 0)
+    {
+      struct extent *x = &e[h->cnt - 1];
 
-  struct indirect_sector doubly_indirect, cur_indirect;
+      if (h->depth == 0)
+        {
+          if (x->first < cut)
+            {
+              if (x->first + x->length > cut)
+                {
+                  free_map_release_deferred (x->start + (cut - x->first),
+                                             x->first + x->length - cut);
+                  x->length = cut - x->first;
+                }
+              return;
+            }
+          free_map_release_deferred (x->start, x->length);
+        }
+      else
+        {
+          int cache_id = cache_load (x->start, CACHE_META);
+          struct extent_node *child = cache[cache_id].addr;
+          bool empty = x->first >= cut;
 
-  block_read(fs_device, ind->data.ptr[DIRECT_LIMIT], &doubly_indirect);
-  int old_data_id = -1;
-  for(; ; cur_sector++)
-  {
-    int data_id = (cur_sector - DIRECT_LIMIT - 1)/128;
-    int indirect_id = (cur_sector - DIRECT_LIMIT - 1)%128;
-    if(indirect_id == 0)
-      free_map_allocate(fs_device, &doubly_indirect.ptr[data_id]);
-    if(old_data_id != data_id)
+          if (empty)
+            extent_free (&child->h, child->e);
+          else
+            {
+              extent_trim (&child->h, child->e, cut);
+              empty = child->h.cnt == 0;
+            }
+          cache_release (cache_id, !empty);
+          if (!empty)
+            return;
+          free_map_release_deferred (x->start, 1);
+        }
+      h->cnt--;
+    }
+}
+
+/* Returns where to look for disk sectors for the data of INODE
+   from byte POS on: just past the sector holding the data before
+   POS if there is one, so that the file stays contiguous, and
+   otherwise just past INODE's last allocation, which starts out
+   as INODE's own sector. */
+static block_sector_t
+data_goal (struct inode *inode, off_t pos)
+{
+  if (pos >= BLOCK_SECTOR_SIZE)
+    {
+      block_sector_t prev = byte_to_sector (inode, pos - BLOCK_SECTOR_SIZE);
+      if (prev != 0 && prev != (block_sector_t) -1)
+        return prev + 1;
+    }
+  return inode->goal;
+}
+
+/* Allocates a sector for INODE's metadata, zeroed, near INODE's
+   data, and stores it in *SECTOR.  Returns false if the disk is
+   full. */
+static bool
+allocate_meta (struct inode *inode, block_sector_t *sector)
+{
+  if (!free_map_allocate_near (inode->goal, 1, sector))
+    return false;
+  zero_sector (*sector, CACHE_META);
+  return true;
+}
+
+/* Points byte POS of INODE, at least DIRECT_SIZE_LIMIT, at data
+   SECTOR, allocating the indirect sectors on the way if they are
+   holes too.  Returns false if the disk is full. */
+static bool
+indirect_map (struct inode *inode, off_t pos, block_sector_t sector)
+{
+  int slot, idx, cache_id;
+  struct indirect_sector *node;
+  block_sector_t child;
+  off_t span;
+  bool top = true;
+
+  pos -= DIRECT_SIZE_LIMIT;
+  slot = DOUBLY_PTR;
+  if (pos >= DOUBLY_SIZE)
+    {
+      slot = TRIPLY_PTR;
+      pos -= DOUBLY_SIZE;
+    }
+  if (inode->data.ptr[slot] == 0)
+    {
+      if (!allocate_meta (inode, &child))
+        return false;
+      inode->data.ptr[slot] = child;
+    }
+
+  child = inode->data.ptr[slot];
+  for (span = index_span (slot); span > BLOCK_SECTOR_SIZE; span /= 128)
+    {
+      bool dirty = false;
+
+      idx = pos / span;
+      pos %= span;
+      cache_id = cache_load (child, CACHE_META);
+      node = cache[cache_id].addr;
+      if (node->ptr[idx] == 0)
+        {
+          if (!allocate_meta (inode, &child))
+            {
+              cache_release (cache_id, false);
+              return false;
+            }
+          node->ptr[idx] = child;
+          if (top && inode->index[slot - DOUBLY_PTR] != NULL)
+            inode->index[slot - DOUBLY_PTR]->ptr[idx] = child;
+          dirty = true;
+        }
+      child = node->ptr[idx];
+      cache_release (cache_id, dirty);
+      top = false;
+    }
+
+  cache_id = cache_load (child, CACHE_META);
+  ((struct indirect_sector *) cache[cache_id].addr)->ptr[pos / span] = sector;
+  cache_release (cache_id, true);
+  return true;
+}
+
+/* Points the CNT sectors of INODE from byte POS on, which must be
+   holes, at the disk sectors from START on.  Returns the number
+   mapped, which is less than CNT only if the disk filled up before
+   the indirect sectors for the rest could be allocated.  The
+   sectors mapped always come first. */
+static size_t
+inode_map (struct inode *inode, off_t pos, block_sector_t start,
+           size_t cnt)
+{
+  size_t i;
+
+  if (has_extents (&inode->data))
+    return extent_add (inode, pos / BLOCK_SECTOR_SIZE, start, cnt) ? cnt : 0;
+  for (i = 0; i < cnt; i++, pos += BLOCK_SECTOR_SIZE)
+    if (pos < DIRECT_SIZE_LIMIT)
+      inode->data.ptr[pos / BLOCK_SECTOR_SIZE] = start + i;
+    else if (!indirect_map (inode, pos, start + i))
+      break;
+  return i;
+}
+
+/* Allocates zeroed sectors for the holes in bytes [OFFSET,
+   OFFSET + SIZE) of INODE.  Each stretch of holes is given the
+   longest contiguous run the free map has, up to its length, so
+   that a large write lands in a few sequential runs and the free
+   map is written once per run rather than once per sector.
+   Sectors held by delayed blocks are not holes here; they are
+   given sectors by inode_commit().
+
+   If DIRECT, the caller is about to write the range straight to
+   disk.  Sectors it covers completely are then left as they are,
+   and the partial ones at either end are zeroed on disk, so that
+   none of them is brought into the cache.
+
+   Returns false if the disk fills up first. */
+static bool
+inode_fill (struct inode *inode, off_t offset, off_t size, bool direct)
+{
+  off_t pos = ROUND_DOWN (offset, BLOCK_SECTOR_SIZE);
+  off_t end = offset + size;
+  bool success = true, changed = false;
+
+  while (pos < end && success)
+    {
+      block_sector_t start;
+      size_t cnt, mapped, i;
+      off_t hole;
+
+      if (byte_to_sector (inode, pos) != 0 || delayed_find (inode, pos) != NULL)
+        {
+          pos += BLOCK_SECTOR_SIZE;
+          continue;
+        }
+      for (hole = pos + BLOCK_SECTOR_SIZE;
+           hole < end && byte_to_sector (inode, hole) == 0
+           && delayed_find (inode, hole) == NULL;
+           hole += BLOCK_SECTOR_SIZE)
+        continue;
+
+      cnt = free_map_allocate_run ((hole - pos) / BLOCK_SECTOR_SIZE,
+                                   data_goal (inode, pos), &start);
+      if (cnt == 0)
+        break;
+      inode->goal = start + cnt;
+
+      /* The data run may have taken the sectors the indirect
+         sectors needed.  Keep what was mapped and give back the
+         rest, which nothing points to. */
+      mapped = inode_map (inode, pos, start, cnt);
+      if (mapped < cnt)
+        {
+          free_map_release (start + mapped, cnt - mapped);
+          success = false;
+        }
+      for (i = 0; i < mapped; i++)
+        {
+          off_t sector_pos = pos + (off_t) i * BLOCK_SECTOR_SIZE;
+          if (!direct)
+            zero_sector (start + i, inode_data_type (inode));
+          else if (sector_pos < offset
+                   || sector_pos + BLOCK_SECTOR_SIZE > end)
+            cache_write_direct (start + i, 1, zeros);
+        }
+      pos += mapped * BLOCK_SECTOR_SIZE;
+      changed = true;
+    }
+  if (changed)
+    meta_write (inode->sector, &inode->data);
+  return pos >= end && success;
+}
+
+/* Orders delayed blocks by position in the file. */
+static bool
+delayed_less (const struct list_elem *a, const struct list_elem *b,
+              void *aux UNUSED)
+{
+  return list_entry (a, struct delayed_block, elem)->pos
+         < list_entry (b, struct delayed_block, elem)->pos;
+}
+
+/* Returns INODE's delayed block for the sector at byte POS, or a
+   null pointer if there is none. */
+static struct delayed_block *
+delayed_find (struct inode *inode, off_t pos)
+{
+  struct list_elem *e;
+
+  pos = ROUND_DOWN (pos, BLOCK_SECTOR_SIZE);
+  for (e = list_begin (&inode->delayed); e != list_end (&inode->delayed);
+       e = list_next (e))
+    {
+      struct delayed_block *b = list_entry (e, struct delayed_block, elem);
+      if (b->pos == pos)
+        return b;
+      if (b->pos > pos)
+        break;
+    }
+  return NULL;
+}
+
+/* Takes one delayed block out of the shared budget and reserves a
+   sector for it.  Returns false if either is exhausted. */
+static bool
+delay_reserve (void)
+{
+  bool success;
+
+  lock_acquire (&delay_lock);
+  success = delayed_cnt < DELAY_LIMIT && free_map_reserve (1);
+  if (success)
+    delayed_cnt++;
+  lock_release (&delay_lock);
+  return success;
+}
+
+/* Returns CNT delayed blocks to the shared budget.  Their sectors
+   have been allocated or unreserved by the caller. */
+static void
+delay_release (size_t cnt)
+{
+  lock_acquire (&delay_lock);
+  delayed_cnt -= cnt;
+  lock_release (&delay_lock);
+}
+
+/* Gives INODE's delayed blocks disk sectors and writes them into
+   the buffer cache.  Runs of adjacent blocks are allocated
+   together, so a file written a block at a time still ends up in
+   long runs.  Returns false if the disk filled up with metadata
+   first, in which case the blocks that could not be mapped stay
+   delayed, still holding their reservations. */
+static bool
+inode_commit (struct inode *inode)
+{
+  enum cache_type type = inode_data_type (inode);
+  bool success = true, changed = false;
+
+  while (!list_empty (&inode->delayed))
+    {
+      struct delayed_block *b;
+      struct list_elem *e;
+      block_sector_t start;
+      size_t run = 1, cnt, mapped, i;
+      off_t pos;
+
+      /* Count the blocks that follow on without a gap. */
+      b = list_entry (list_front (&inode->delayed), struct delayed_block, elem);
+      pos = b->pos;
+      for (e = list_next (&b->elem); e != list_end (&inode->delayed);
+           e = list_next (e))
+        if (list_entry (e, struct delayed_block, elem)->pos
+            == pos + (off_t) run * BLOCK_SECTOR_SIZE)
+          run++;
+        else
+          break;
+
+      /* The reservation should leave a free sector, but if the
+         disk is full after all the blocks simply stay delayed. */
+      cnt = free_map_allocate_reserved (run, data_goal (inode, pos), &start);
+      if (cnt == 0)
+        {
+          success = false;
+          break;
+        }
+      inode->goal = start + cnt;
+
+      /* Only the blocks mapped leave the list.  Sectors the indirect
+         sectors left no room to map go back to the reservation. */
+      mapped = inode_map (inode, pos, start, cnt);
+      if (mapped < cnt)
+        {
+          free_map_release_reserved (start + mapped, cnt - mapped);
+          success = false;
+        }
+      if (mapped > 0)
+        changed = true;
+      for (i = 0; i < mapped; i++)
+        {
+          int cache_id = cache_claim (start + i, type);
+          b = list_entry (list_pop_front (&inode->delayed),
+                          struct delayed_block, elem);
+          memcpy (cache[cache_id].addr, b->data, BLOCK_SECTOR_SIZE);
+          cache_release (cache_id, true);
+          delayed_free (b);
+        }
+      delay_release (mapped);
+      if (!success)
+        break;
+    }
+  if (changed)
+    meta_write (inode->sector, &inode->data);
+  return success;
+}
+
+/* Drops INODE's delayed blocks without writing them anywhere, for
+   an inode being deleted. */
+static void
+inode_discard (struct inode *inode)
+{
+  size_t cnt = 0;
+
+  while (!list_empty (&inode->delayed))
     {
-      if(old_data_id != -1)
-        block_write(fs_device, doubly_indirect.ptr[old_data_id], &cur_indirect);
+      delayed_free (list_entry (list_pop_front (&inode->delayed),
+                                struct delayed_block, elem));
+      cnt++;
+    }
+  if (cnt > 0)
+    {
+      free_map_unreserve (cnt);
+      delay_release (cnt);
+    }
+}
+
+/* Returns INODE's delayed block for the sector at byte POS, which
+   must be a hole, creating a zeroed one if there is none yet.  If
+   the shared budget is used up, INODE's own delayed blocks are
+   committed to make room.  Returns a null pointer if INODE's data
+   is metadata, which is always allocated as it is written, or if
+   no block can be had. */
+static struct delayed_block *
+delayed_get (struct inode *inode, off_t pos)
+{
+  struct delayed_block *b;
+
+  if (inode_data_type (inode) != CACHE_DATA)
+    return NULL;
+  b = delayed_find (inode, pos);
+  if (b != NULL)
+    return b;
 
-      block_read(fs_device, doubly_indirect.ptr[data_id], &cur_indirect);
+  if (!delay_reserve ())
+    {
+      if (list_empty (&inode->delayed))
+        return NULL;
+      inode_commit (inode);
+      if (!delay_reserve ())
+        return NULL;
+    }
+  b = malloc (sizeof *b);
+  if (b != NULL)
+    {
+      b->data = malloc (BLOCK_SECTOR_SIZE);
+      if (b->data == NULL)
+        {
+          free (b);
+          b = NULL;
+        }
+    }
+  if (b == NULL)
+    {
+      free_map_unreserve (1);
+      delay_release (1);
+      return NULL;
     }
+  b->pos = ROUND_DOWN (pos, BLOCK_SECTOR_SIZE);
+  memset (b->data, 0, BLOCK_SECTOR_SIZE);
+  list_insert_ordered (&inode->delayed, &b->elem, delayed_less, NULL);
+  return b;
+}
+
+/* Moves the data of inline inode IND out to a data sector, growing
+   it to LENGTH bytes on the way.  Returns true if successful. */
+static bool
+inode_uninline (struct inode *ind, off_t length)
+{
+  uint8_t data[INLINE_MAX];
+  off_t old_length = ind->data.length;
+  int cache_id;
 
-    free_map_allocate(1, &cur_indirect.ptr[indirect_id]);
-    block_write(fs_device, cur_indirect.ptr[indirect_id], zeroes);
-    old_data_id = data_id;
-    if(cur_sector == target_sector)
+  memcpy (data, ind->data.inline_data, old_length);
+  memset (ind->data.inline_data, 0, INLINE_MAX);
+  ind->data.flags &= ~INODE_INLINE;
+  ind->data.length = length;
+  if (old_length == 0)
     {
-      block_write(fs_device, doubly_indirect.ptr[data_id], &cur_indirect);
-      block_write(fs_device, ind->data.ptr[DIRECT_LIMIT], &doubly_indirect);
-      block_write(fs_device, ind->sector, &ind->data);
-      free(zeroes);
+      meta_write (ind->sector, &ind->data);
       return true;
     }
-  }
-  // Not reached.
+
+  if (!inode_fill (ind, 0, old_length, false))
+    {
+      ind->data.flags |= INODE_INLINE;
+      ind->data.length = old_length;
+      memcpy (ind->data.inline_data, data, old_length);
+      return false;
+    }
+
+  /* The sector was just zeroed in the cache, so this is a hit. */
+  cache_id = cache_load (byte_to_sector (ind, 0), inode_data_type (ind));
+  memcpy (cache[cache_id].addr, data, old_length);
+  cache_release (cache_id, true);
+  return true;
+}
+
+/* Expand an inode to given length.  No sectors are allocated: the
+   new part of the file is a hole, which reads as zeroes until it is
+   written.  Also update to on-disk inode. Return true if successful. */
+bool inode_expand(struct inode *ind, off_t length)
+{
+  if(!has_extents(&ind->data) && length > MAX_FILE_SIZE) return false;
+  if(is_inline(&ind->data) && length > INLINE_MAX)
+    return inode_uninline(ind, length);
+  ind->data.length = length;
+  meta_write(ind->sector, &ind->data);
   return true;
 }
 
-/* Free all the on-disk data of an inode. */
+/* A run of sectors being released.  inode_free() gathers adjacent
+   sectors into runs and releases them with the free map file
+   written once at the end, instead of once per sector. */
+struct release_run
+  {
+    block_sector_t start;               /* First sector. */
+    size_t cnt;                         /* Sectors, 0 if none yet. */
+  };
+
+/* Releases the sectors gathered in RUN, if any, and empties it. */
+static void
+release_flush (struct release_run *run)
+{
+  if (run->cnt > 0)
+    free_map_release_deferred (run->start, run->cnt);
+  run->cnt = 0;
+}
+
+/* Adds SECTOR to RUN, releasing what RUN held first unless SECTOR
+   extends it. */
+static void
+release_add (struct release_run *run, block_sector_t sector)
+{
+  if (run->cnt > 0 && sector == run->start + run->cnt)
+    {
+      run->cnt++;
+      return;
+    }
+  release_flush (run);
+  run->start = sector;
+  run->cnt = 1;
+}
+
+/* Frees indirect SECTOR, LEVELS levels above the data, along with
+   everything under it, gathering the sectors into RUN.  Pointers
+   are read one at a time from the cache rather than copied, to
+   keep the recursion's stack small. */
+static void
+indirect_free (block_sector_t sector, int levels, struct release_run *run)
+{
+  int i;
+
+  for (i = 0; i < 128; i++)
+    {
+      block_sector_t child = indirect_lookup (sector, i);
+      if (child == 0)
+        continue;
+      if (levels > 1)
+        indirect_free (child, levels - 1, run);
+      else
+        release_add (run, child);
+    }
+  release_add (run, sector);
+}
+
+/* Free all the on-disk data of an inode.  Holes have nothing to
+   free.  The free map file is written once, however large the
+   inode, along with any other releases deferred until now. */
 void inode_free(struct inode *ind)
 {
+  struct release_run run = {0, 0};
   int cur_sector = bytes_to_sectors(ind->data.length);
-  if(cur_sector == 0) return;
-
   int i;
 
-  // Free direct data.
-  for(i=1; i<=DIRECT_LIMIT; i++)
+  if(is_inline(&ind->data))
+    ;
+  else if(has_extents(&ind->data))
+    extent_free(&ind->data.root.h, ind->data.root.e);
+  else
   {
-    free_map_release(ind->data.ptr[i - 1], 1);
-    if(i == cur_sector) return;
+    // Free direct data.
+    for(i=0; i<DIRECT_LIMIT && i<cur_sector; i++)
+      if(ind->data.ptr[i] != 0)
+        release_add(&run, ind->data.ptr[i]);
+
+    // Free doubly and triply indirect data.
+    if(ind->data.ptr[DOUBLY_PTR] != 0)
+      indirect_free(ind->data.ptr[DOUBLY_PTR], 2, &run);
+    if(ind->data.ptr[TRIPLY_PTR] != 0)
+      indirect_free(ind->data.ptr[TRIPLY_PTR], 3, &run);
+    release_flush(&run);
   }
+  free_map_flush();
+}
 
-  // Free doubly indirect data.
-  struct indirect_sector doubly_indirect, cur_indirect;
-  block_read(fs_device, ind->data.ptr[DIRECT_LIMIT], &doubly_indirect);
-  int old_data_id = -1;
-  for(i=DIRECT_LIMIT+1; ; i++)
-  {
-    int data_id = (i - DIRECT_LIMIT - 1)/128;
-    int indirect_id = (i - DIRECT_LIMIT - 1)%128;
-    if(old_data_id != data_id)
+/* Frees the data sectors that the tree of indirect sectors under
+   SECTOR, LEVELS levels above the data, maps from data sector
+   FIRST on, counted from the start of the tree, and the indirect
+   sectors that lie wholly past FIRST.  Gathers the sectors into
+   RUN and clears the pointers to them. */
+static void
+indirect_trim (block_sector_t sector, int levels, size_t first,
+               struct release_run *run)
+{
+  int cache_id = cache_load (sector, CACHE_META);
+  struct indirect_sector *node = cache[cache_id].addr;
+  size_t cover = levels == 1 ? 1 : levels == 2 ? 128 : 128 * 128;
+  bool dirty = false;
+  int i;
+
+  for (i = 0; i < 128; i++)
     {
-      if(old_data_id != -1)
-        free_map_release(doubly_indirect.ptr[old_data_id], 1);
-      block_read(fs_device, doubly_indirect.ptr[data_id], &cur_indirect);
+      block_sector_t child = node->ptr[i];
+      size_t begin = i * cover;
+
+      if (child == 0 || begin + cover <= first)
+        continue;
+      if (begin < first)
+        {
+          indirect_trim (child, levels - 1, first - begin, run);
+          continue;
+        }
+      if (levels > 1)
+        indirect_free (child, levels - 1, run);
+      else
+        release_add (run, child);
+      node->ptr[i] = 0;
+      dirty = true;
     }
-    free_map_release(cur_indirect.ptr[indirect_id], 1);
-    if(i == cur_sector)
+  cache_release (cache_id, dirty);
+}
+
+/* Releases every sector of INODE that maps data at or past byte
+   LENGTH, with the indirect sectors or extent nodes that leaves
+   mapping nothing, and clears the pointers to them.  Undoes a
+   growth that failed part way, after which the length goes back
+   to LENGTH and nothing else would ever free those sectors. */
+static void
+inode_unmap (struct inode *inode, off_t length)
+{
+  struct inode_disk *d = &inode->data;
+  struct release_run run = {0, 0};
+  size_t cut = bytes_to_sectors (length);
+  size_t start = DIRECT_LIMIT;
+  size_t i;
+  int slot;
+
+  if (is_inline (d))
+    return;
+  if (has_extents (d))
+    extent_trim (&d->root.h, d->root.e, cut);
+  else
     {
-      free_map_release(doubly_indirect.ptr[data_id], 1);
-      free_map_release(ind->data.ptr[DIRECT_LIMIT], 1);
-      return;
+      for (i = cut; i < DIRECT_LIMIT; i++)
+        if (d->ptr[i] != 0)
+          {
+            release_add (&run, d->ptr[i]);
+            d->ptr[i] = 0;
+          }
+      for (slot = DOUBLY_PTR; slot <= TRIPLY_PTR; slot++)
+        {
+          int levels = slot == DOUBLY_PTR ? 2 : 3;
+
+          if (d->ptr[slot] != 0)
+            {
+              if (cut <= start)
+                {
+                  indirect_free (d->ptr[slot], levels, &run);
+                  d->ptr[slot] = 0;
+                }
+              else
+                indirect_trim (d->ptr[slot], levels, cut - start, &run);
+
+              /* The copy of the top sector may be out of date. */
+              free (inode->index[slot - DOUBLY_PTR]);
+              inode->index[slot - DOUBLY_PTR] = NULL;
+            }
+          start += DOUBLY_SIZE / BLOCK_SECTOR_SIZE;
+        }
+      release_flush (&run);
     }
-    old_data_id = data_id;
-  }
+  free_map_flush ();
 }
 
-/* List of open inodes, so that opening a single inode twice
+/* Open inodes, by sector, so that opening a single inode twice
    returns the same `struct inode'. */
-static struct list open_inodes;
+static struct hash open_inodes;
+
+/* Protects open_inodes and the open counts of its inodes. */
+static struct lock open_inodes_lock;
+
+/* Hashes an inode by its sector. */
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct inode, elem)->sector);
+}
+
+/* Orders inodes by sector. */
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return hash_entry (a, struct inode, elem)->sector
+         < hash_entry (b, struct inode, elem)->sector;
+}
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
+  if (!hash_init (&open_inodes, inode_hash, inode_less, NULL))
+    PANIC ("can't create open inode table");
+  lock_init (&open_inodes_lock);
+  lock_init (&delay_lock);
 }
 
 /* Initializes an inode with LENGTH bytes of data and
    writes the new inode to sector SECTOR on the file system
-   device.
+   device.  Data that fits is kept in the inode itself; otherwise
+   the inode maps it with an extent tree if the file system uses
+   extents.
    Returns true if successful.
    Returns false if memory or disk allocation fails. */
 bool
@@ -233,10 +1282,16 @@ inode_create (block_sector_t sector, off_t length, bool is_dir)
   ASSERT (length >= 0);
   struct inode *tmp = malloc(sizeof(struct inode));
   tmp->sector = sector;
+  memset(&tmp->data, 0, sizeof tmp->data);
   tmp->data.length = 0;
   tmp->data.is_dir = is_dir;
-  tmp->data.magic = INODE_MAGIC;
+  tmp->data.magic = filesys_extents ? EXTENT_MAGIC : INODE_MAGIC;
+  if(length <= INLINE_MAX)
+    tmp->data.flags = INODE_INLINE;
   tmp->data.parent = ROOT_DIR_SECTOR;
+  tmp->index[0] = tmp->index[1] = NULL;
+  lock_init(&tmp->lock);
+  tmp->goal = sector;
   if(!inode_expand(tmp, length))
   {
     free(tmp);
@@ -252,33 +1307,48 @@ inode_create (block_sector_t sector, off_t length, bool is_dir)
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
+  struct inode key;
+  struct hash_elem *e;
   struct inode *inode;
 
   /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
+  key.sector = sector;
+  lock_acquire (&open_inodes_lock);
+  e = hash_find (&open_inodes, &key.elem);
+  if (e != NULL)
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
-        {
-          inode_reopen (inode);
-          return inode; 
-        }
+      inode = hash_entry (e, struct inode, elem);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+      return inode; 
     }
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
-    return NULL;
+    {
+      lock_release (&open_inodes_lock);
+      return NULL;
+    }
 
   /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
   inode->sector = sector;
+  hash_insert (&open_inodes, &inode->elem);
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
-  block_read (fs_device, inode->sector, &inode->data);
+  inode->ra_next = 0;
+  inode->ra_end = 0;
+  inode->ra_window = 0;
+  inode->index[0] = inode->index[1] = NULL;
+  rwlock_init (&inode->rw);
+  lock_init (&inode->lock);
+  lock_init (&inode->dir_lock);
+  list_init (&inode->delayed);
+  inode->goal = sector;
+  meta_read (inode->sector, &inode->data);
+  inode_trim (inode);
+  lock_release (&open_inodes_lock);
   return inode;
 }
 
@@ -287,7 +1357,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&open_inodes_lock);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+    }
   return inode;
 }
 
@@ -304,27 +1378,98 @@ inode_get_inumber (const struct inode *inode)
 void
 inode_close (struct inode *inode) 
 {
+  bool last, written = false;
+
   /* Ignore null pointer. */
   if (inode == NULL)
     return;
+
+  /* The last opener writes the inode back while it is still in
+     the table, holding its open count, so that an inode_open()
+     meanwhile finds this copy instead of reading the stale one
+     from disk.  Whoever opens it then may write to it and close
+     it again before we are done, so go round until there is
+     nothing left to commit. */
+  lock_acquire (&open_inodes_lock);
+  while (inode->open_cnt == 1 && !inode->removed
+         && (!written || !list_empty (&inode->delayed)))
+    {
+      lock_release (&open_inodes_lock);
+      rwlock_acquire_write (&inode->rw);
+      if (!inode_commit (inode))
+        inode_discard (inode);
+      meta_write (inode->sector, &inode->data);
+      rwlock_release_write (&inode->rw);
+      written = true;
+      lock_acquire (&open_inodes_lock);
+    }
+
+  /* Once out of the table nobody else can reach the inode, so
+     the rest needs no lock. */
+  last = --inode->open_cnt == 0;
+  if (last)
+    hash_delete (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
+
   /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  if (last)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
- 
       /* Deallocate blocks if removed. */
       if (inode->removed) 
       {
-        free_map_release (inode->sector, 1);
+        inode_discard (inode);
+        free_map_release_deferred (inode->sector, 1);
         inode_free(inode);
       }
-      else
-        block_write(fs_device, inode->sector, &inode->data);
+      free (inode->index[0]);
+      free (inode->index[1]);
       free (inode); 
     }
 }
 
+/* Gives the delayed blocks of every open inode disk sectors, so
+   that the buffer cache holds all the data written so far.  The
+   write-behind thread calls this every pass, so that data written
+   to a file that stays open reaches the disk within one flush
+   interval too, and filesys_done() calls it at shutdown.  The
+   inodes are collected under open_inodes_lock and held open while
+   they are committed, since their openers, or the write-behind
+   thread, may close them meanwhile. */
+void
+inode_commit_all (void)
+{
+  struct inode **inodes;
+  struct hash_iterator i;
+  size_t cnt = 0, j;
+
+  lock_acquire (&open_inodes_lock);
+  inodes = malloc (sizeof *inodes * (hash_size (&open_inodes) + 1));
+  if (inodes != NULL)
+    {
+      hash_first (&i, &open_inodes);
+      while (hash_next (&i))
+        {
+          struct inode *inode = hash_entry (hash_cur (&i), struct inode,
+                                            elem);
+          if (!list_empty (&inode->delayed))
+            {
+              inode->open_cnt++;
+              inodes[cnt++] = inode;
+            }
+        }
+    }
+  lock_release (&open_inodes_lock);
+
+  for (j = 0; j < cnt; j++)
+    {
+      rwlock_acquire_write (&inodes[j]->rw);
+      inode_commit (inodes[j]);
+      rwlock_release_write (&inodes[j]->rw);
+      inode_close (inodes[j]);
+    }
+  free (inodes);
+}
+
 /* Marks INODE to be deleted when it is closed by the last caller who
    has it open. */
 void
@@ -334,17 +1479,103 @@ inode_remove (struct inode *inode)
   inode->removed = true;
 }
 
+/* Returns how many of the CNT whole sectors of INODE from byte
+   OFFSET on, the first of which is in disk sector SECTOR, follow
+   it on disk without a gap, so that they can be moved in one
+   transfer.  At least 1. */
+static size_t
+sector_run (struct inode *inode, off_t offset, block_sector_t sector,
+            size_t cnt)
+{
+  size_t run = 1;
+
+  while (run < cnt
+         && byte_to_sector (inode, offset + run * BLOCK_SECTOR_SIZE)
+            == sector + run)
+    run++;
+  return run;
+}
+
+/* Updates INODE's sequential-access detector for a read of SIZE
+   bytes at OFFSET, and queues the sectors the reader is likely to
+   want next.  The window grows while reads keep following each
+   other and collapses on the first one that does not. */
+static void
+inode_readahead (struct inode *inode, off_t offset, off_t size)
+{
+  off_t first, end, limit, pos;
+
+  lock_acquire (&inode->lock);
+  if (offset != inode->ra_next)
+    {
+      inode->ra_window = 0;
+      inode->ra_end = 0;
+    }
+  else if (inode->ra_window == 0)
+    inode->ra_window = READAHEAD_MIN;
+  else if (inode->ra_window * 2 <= READAHEAD_MAX)
+    inode->ra_window *= 2;
+  inode->ra_next = offset + size;
+  if (inode->ra_window == 0)
+    {
+      lock_release (&inode->lock);
+      return;
+    }
+
+  /* Queue whole sectors past the ones this read touches that
+     have not been queued already. */
+  end = ROUND_UP (offset + size, BLOCK_SECTOR_SIZE);
+  if (end < inode->ra_end)
+    end = inode->ra_end;
+  limit = ROUND_UP (offset + size, BLOCK_SECTOR_SIZE)
+          + inode->ra_window * BLOCK_SECTOR_SIZE;
+  if (limit > inode_length (inode))
+    limit = inode_length (inode);
+  first = end;
+  if (end < limit)
+    end = first + ROUND_UP (limit - first, BLOCK_SECTOR_SIZE);
+  inode->ra_end = end;
+  lock_release (&inode->lock);
+
+  /* Queue outside the lock, since looking sectors up may need
+     it. */
+  for (pos = first; pos < limit; pos += BLOCK_SECTOR_SIZE)
+    {
+      block_sector_t sector = byte_to_sector (inode, pos);
+      if (sector != 0)
+        cache_readahead (sector);
+    }
+}
+
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
    Returns the number of bytes actually read, which may be less
-   than SIZE if an error occurs or end of file is reached. */
-off_t
-inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) 
+   than SIZE if an error occurs or end of file is reached.
+   Holes read as zeroes without touching the disk.
+   If DIRECT, whole sectors bypass the buffer cache.
+   The caller must hold INODE's lock for reading. */
+static off_t
+inode_read_locked (struct inode *inode, void *buffer_, off_t size,
+                   off_t offset, bool direct)
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
 
   if(offset >= inode->data.length) return 0;
 
+  if (is_inline (&inode->data))
+    {
+      if (size > inode->data.length - offset)
+        size = inode->data.length - offset;
+      memcpy (buffer, inode->data.inline_data + offset, size);
+      return size;
+    }
+
+  /* Directories are read an entry or a hash bucket at a time, in
+     no useful order, so reading ahead would only fill the cache
+     with buckets nobody asked for. */
+  if (!direct && !inode->data.is_dir)
+    inode_readahead (inode, offset, size);
+
   while (size > 0) 
     {
       /* Disk sector to read, starting byte offset within sector. */
@@ -361,10 +1592,30 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
 
-      int cache_id = cache_load(sector_idx);
-      cache[cache_id].accessed = true;
-      cache[cache_id].open_cnt--;
-      memcpy (buffer + bytes_read, cache[cache_id].addr + sector_ofs, chunk_size);
+      if (sector_idx == 0)
+        {
+          /* A hole, unless it has been written since and is waiting
+             for a sector. */
+          struct delayed_block *b = delayed_find (inode, offset);
+          if (b != NULL)
+            memcpy (buffer + bytes_read, b->data + sector_ofs, chunk_size);
+          else
+            memset (buffer + bytes_read, 0, chunk_size);
+        }
+      else if (direct && sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
+        {
+          size_t run = sector_run (inode, offset, sector_idx,
+                                   (size < inode_left ? size : inode_left)
+                                   / BLOCK_SECTOR_SIZE);
+          cache_read_direct (sector_idx, run, buffer + bytes_read);
+          chunk_size = run * BLOCK_SECTOR_SIZE;
+        }
+      else
+        {
+          int cache_id = cache_load(sector_idx, inode_data_type (inode));
+          memcpy (buffer + bytes_read, cache[cache_id].addr + sector_ofs, chunk_size);
+          cache_release(cache_id, false);
+        }
       
       /* Advance. */
       size -= chunk_size;
@@ -375,23 +1626,71 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
   return bytes_read;
 }
 
+/* Like inode_read_locked(), but takes INODE's lock for reading,
+   so that reads of one inode can proceed together. */
+static off_t
+inode_read (struct inode *inode, void *buffer, off_t size, off_t offset,
+            bool direct)
+{
+  off_t bytes_read;
+
+  rwlock_acquire_read (&inode->rw);
+  bytes_read = inode_read_locked (inode, buffer, size, offset, direct);
+  rwlock_release_read (&inode->rw);
+  return bytes_read;
+}
+
+/* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
+   Returns the number of bytes actually read, which may be less
+   than SIZE if an error occurs or end of file is reached. */
+off_t
+inode_read_at (struct inode *inode, void *buffer, off_t size, off_t offset) 
+{
+  return inode_read (inode, buffer, size, offset, false);
+}
+
+/* Like inode_read_at(), but moves whole sectors straight from the
+   disk into BUFFER instead of through the buffer cache.  Sectors
+   that are already cached are copied from the cache. */
+off_t
+inode_read_direct (struct inode *inode, void *buffer, off_t size,
+                   off_t offset)
+{
+  return inode_read (inode, buffer, size, offset, true);
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
    less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
-off_t
-inode_write_at (struct inode *inode, const void *buffer_, off_t size,
-                off_t offset) 
+   If DIRECT, whole sectors bypass the buffer cache.
+   The caller must hold INODE's lock for writing. */
+static off_t
+inode_write_locked (struct inode *inode, const void *buffer_, off_t size,
+                    off_t offset, bool direct)
 {
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
+  off_t old_length = inode->data.length;
 
   if (inode->deny_write_cnt)
     return 0;
 
-  if(offset + size > inode->data.length)
-    ASSERT(inode_expand(inode, offset + size));
+  if (offset + size > inode->data.length
+      && !inode_expand (inode, offset + size))
+    return 0;
+  /* Writes that bypass the cache need their sectors now. */
+  if (direct && !is_inline (&inode->data))
+    {
+      inode_commit (inode);
+      inode_fill (inode, offset, size, true);
+    }
+
+  if (is_inline (&inode->data))
+    {
+      memcpy (inode->data.inline_data + offset, buffer, size);
+      meta_write (inode->sector, &inode->data);
+      return size;
+    }
 
   while (size > 0) 
     {
@@ -409,11 +1708,48 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       if (chunk_size <= 0)
         break;
 
-      int cache_id = cache_load(sector_idx);
-      cache[cache_id].accessed = true;
-      cache[cache_id].dirty = true;
-      cache[cache_id].open_cnt--;
-      memcpy(cache[cache_id].addr + sector_ofs, buffer + bytes_written, chunk_size);
+      /* A hole gets a delayed block, which is given a sector only
+         when the inode is committed.  Failing that, allocate the
+         rest of the write now; a hole left by inode_fill() means
+         the disk is full. */
+      if (sector_idx == 0 && !direct)
+        {
+          struct delayed_block *b = delayed_get (inode, offset);
+          if (b != NULL)
+            {
+              memcpy (b->data + sector_ofs, buffer + bytes_written,
+                      chunk_size);
+              size -= chunk_size;
+              offset += chunk_size;
+              bytes_written += chunk_size;
+              continue;
+            }
+          inode_commit (inode);
+          inode_fill (inode, offset, size, false);
+          sector_idx = byte_to_sector (inode, offset);
+        }
+      if (sector_idx == 0)
+        break;
+
+      /* A whole-sector write need not read the old contents. */
+      if (direct && sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
+        {
+          size_t run = sector_run (inode, offset, sector_idx,
+                                   (size < inode_left ? size : inode_left)
+                                   / BLOCK_SECTOR_SIZE);
+          cache_write_direct (sector_idx, run, buffer + bytes_written);
+          chunk_size = run * BLOCK_SECTOR_SIZE;
+        }
+      else
+        {
+          int cache_id;
+          if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
+            cache_id = cache_claim(sector_idx, inode_data_type (inode));
+          else
+            cache_id = cache_load(sector_idx, inode_data_type (inode));
+          memcpy(cache[cache_id].addr + sector_ofs, buffer + bytes_written, chunk_size);
+          cache_release(cache_id, true);
+        }
 
       /* Advance. */
       size -= chunk_size;
@@ -421,16 +1757,89 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       bytes_written += chunk_size;
     }
 
+  /* Out of disk space: keep only what was written of the growth. */
+  if (size > 0 && inode->data.length > old_length)
+    {
+      inode->data.length = offset > old_length ? offset : old_length;
+      meta_write (inode->sector, &inode->data);
+    }
+
   return bytes_written;
 }
 
+/* Like inode_write_locked(), but takes INODE's lock for writing,
+   which keeps out readers and other writers of the inode. */
+static off_t
+inode_write (struct inode *inode, const void *buffer, off_t size,
+             off_t offset, bool direct)
+{
+  off_t bytes_written;
+
+  rwlock_acquire_write (&inode->rw);
+  bytes_written = inode_write_locked (inode, buffer, size, offset, direct);
+  rwlock_release_write (&inode->rw);
+  return bytes_written;
+}
+
+/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
+   Returns the number of bytes actually written, which may be
+   less than SIZE if an error occurs.  Writing past end of file
+   extends the inode. */
+off_t
+inode_write_at (struct inode *inode, const void *buffer, off_t size,
+                off_t offset) 
+{
+  return inode_write (inode, buffer, size, offset, false);
+}
+
+/* Makes INODE at least LENGTH bytes long and gives every sector
+   below LENGTH a disk sector, so that later writes there cannot
+   fail for lack of space.  Returns false, leaving INODE's length
+   as it was, if the disk fills up first. */
+bool
+inode_allocate (struct inode *inode, off_t length)
+{
+  off_t old_length;
+  bool success;
+
+  rwlock_acquire_write (&inode->rw);
+  old_length = inode->data.length;
+  success = length <= old_length || inode_expand (inode, length);
+  if (success && !is_inline (&inode->data))
+    {
+      inode_commit (inode);
+      success = inode_fill (inode, 0, length, false);
+    }
+  if (!success && inode->data.length > old_length)
+    {
+      /* Give back what the growth got before the disk filled. */
+      inode_unmap (inode, old_length);
+      inode->data.length = old_length;
+      meta_write (inode->sector, &inode->data);
+    }
+  rwlock_release_write (&inode->rw);
+  return success;
+}
+
+/* Like inode_write_at(), but moves whole sectors straight from
+   BUFFER to the disk instead of through the buffer cache.  Cached
+   copies of those sectors are updated to match. */
+off_t
+inode_write_direct (struct inode *inode, const void *buffer, off_t size,
+                    off_t offset)
+{
+  return inode_write (inode, buffer, size, offset, true);
+}
+
 /* Disables writes to INODE.
    May be called at most once per inode opener. */
 void
 inode_deny_write (struct inode *inode) 
 {
+  lock_acquire (&inode->lock);
   inode->deny_write_cnt++;
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
+  lock_release (&inode->lock);
 }
 
 /* Re-enables writes to INODE.
@@ -439,9 +1848,11 @@ inode_deny_write (struct inode *inode)
 void
 inode_allow_write (struct inode *inode) 
 {
+  lock_acquire (&inode->lock);
   ASSERT (inode->deny_write_cnt > 0);
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
   inode->deny_write_cnt--;
+  lock_release (&inode->lock);
 }
 
 /* Returns the length, in bytes, of INODE's data. */
@@ -451,6 +1862,32 @@ inode_length (const struct inode *inode)
   return inode->data.length;
 }
 
+/* Returns true if INODE maps its data with an extent tree. */
+bool
+inode_has_extents (const struct inode *inode)
+{
+  return has_extents (&inode->data);
+}
+
+/* Returns true if INODE, a directory, keeps its entries in hash
+   buckets rather than in one array. */
+bool
+inode_is_hashed (const struct inode *inode)
+{
+  return (inode->data.flags & INODE_HASHED) != 0;
+}
+
+/* Marks INODE, a directory, as keeping its entries in hash
+   buckets. */
+void
+inode_set_hashed (struct inode *inode)
+{
+  rwlock_acquire_write (&inode->rw);
+  inode->data.flags |= INODE_HASHED;
+  meta_write (inode->sector, &inode->data);
+  rwlock_release_write (&inode->rw);
+}
+
 bool inode_isdir(const struct inode *inode)
 {
   return inode->data.is_dir;
@@ -468,5 +1905,25 @@ void inode_set_parent(struct inode *inode, block_sector_t parent)
 
 int inode_get_open_cnt(const struct inode *inode)
 {
-  return inode->open_cnt;
-}
\ No newline at end of file
+  int cnt;
+
+  lock_acquire (&open_inodes_lock);
+  cnt = inode->open_cnt;
+  lock_release (&open_inodes_lock);
+  return cnt;
+}
+/* Locks INODE, a directory, so that its entries can be looked up
+   and changed without interference from other threads.
+   Directories are locked parent before child. */
+void
+inode_lock_dir (struct inode *inode)
+{
+  lock_acquire (&inode->dir_lock);
+}
+
+/* Unlocks INODE, a directory locked with inode_lock_dir(). */
+void
+inode_unlock_dir (struct inode *inode)
+{
+  lock_release (&inode->dir_lock);
+}
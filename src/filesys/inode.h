@@ -14,13 +14,23 @@ struct inode *inode_reopen (struct inode *);
 block_sector_t inode_get_inumber (const struct inode *);
 void inode_close (struct inode *);
 void inode_remove (struct inode *);
+void inode_commit_all (void);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
+off_t inode_read_direct (struct inode *, void *, off_t size, off_t offset);
+off_t inode_write_direct (struct inode *, const void *, off_t size,
+                          off_t offset);
+bool inode_allocate (struct inode *, off_t length);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
 off_t inode_length (const struct inode *);
+bool inode_has_extents (const struct inode *);
+bool inode_is_hashed (const struct inode *);
+void inode_set_hashed (struct inode *);
 bool inode_isdir(const struct inode *inode);
 int inode_get_parent(const struct inode *inode);
 void inode_set_parent(struct inode *inode, block_sector_t parent);
 int inode_get_open_cnt(const struct inode *inode);
+void inode_lock_dir (struct inode *);
+void inode_unlock_dir (struct inode *);
 #endif /* filesys/inode.h */
@@ -0,0 +1,17 @@
+#ifndef __LIB_CACHE_STATS_H
+#define __LIB_CACHE_STATS_H
+
+/* Buffer cache counters, as kept by filesys/cache.c and returned
+   to user programs by the cachestat system call. */
+struct cache_stats
+  {
+    long long hits;             /* Lookups that found the sector. */
+    long long misses;           /* Lookups that read it from disk. */
+    long long evictions;        /* Sectors dropped to make room. */
+    long long writebacks;       /* Dirty sectors written to disk. */
+    long long readahead_hits;   /* Hits on sectors read ahead. */
+    long long lock_waits;       /* Times cache_lock was contended. */
+    long long lock_wait_ticks;  /* Timer ticks spent waiting for it. */
+  };
+
+#endif /* lib/cache-stats.h */
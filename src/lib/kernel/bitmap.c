@@ -246,21 +246,40 @@ bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
   return value_cnt;
 }
 
+/* Returns the index of the first bit in B at or after START, and
+   before END, that is set to VALUE, or END if there is none.
+   Looks at a whole element at a time, using the processor's
+   find-first-set instruction to pick out the bit. */
+static size_t
+find_bit (const struct bitmap *b, size_t start, size_t end, bool value)
+{
+  while (start < end)
+    {
+      size_t idx = elem_idx (start);
+      elem_type bits = value ? b->bits[idx] : ~b->bits[idx];
+
+      /* Ignore the bits before START. */
+      bits &= (elem_type) -1 << (start % ELEM_BITS);
+      if (bits != 0)
+        {
+          size_t bit = idx * ELEM_BITS + __builtin_ctzl (bits);
+          return bit < end ? bit : end;
+        }
+      start = (idx + 1) * ELEM_BITS;
+    }
+  return end;
+}
+
 /* Returns true if any bits in B between START and START + CNT,
    exclusive, are set to VALUE, and false otherwise. */
 bool
 bitmap_contains (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
-  size_t i;
-  
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      return true;
-  return false;
+  return find_bit (b, start, start + cnt, value) < start + cnt;
 }
 
 /* Returns true if any bits in B between START and START + CNT,
@@ -292,22 +311,34 @@ bitmap_all (const struct bitmap *b, size_t start, size_t cnt)
 /* Finds and returns the starting index of the first group of CNT
    consecutive bits in B at or after START that are all set to
    VALUE.
-   If there is no such group, returns BITMAP_ERROR. */
+   If there is no such group, returns BITMAP_ERROR.
+
+   Rather than testing every starting index, skips to the next bit
+   set to VALUE and then to the next bit after it set to !VALUE,
+   an element at a time, so a group that spans elements costs no
+   more than one that does not. */
 size_t
 bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
 
-  if (cnt <= b->bit_cnt) 
+  if (cnt > b->bit_cnt || start > b->bit_cnt - cnt)
+    return BITMAP_ERROR;
+  if (cnt == 0)
+    return start;
+  for (;;)
     {
-      size_t last = b->bit_cnt - cnt;
-      size_t i;
-      for (i = start; i <= last; i++)
-        if (!bitmap_contains (b, i, cnt, !value))
-          return i; 
+      size_t first = find_bit (b, start, b->bit_cnt, value);
+      size_t end;
+
+      if (first > b->bit_cnt - cnt)
+        return BITMAP_ERROR;
+      end = find_bit (b, first, first + cnt, !value);
+      if (end == first + cnt)
+        return first;
+      start = end;
     }
-  return BITMAP_ERROR;
 }
 
 /* Finds the first group of CNT consecutive bits in B at or after
@@ -359,6 +390,28 @@ bitmap_write (const struct bitmap *b, struct file *file)
   off_t size = byte_cnt (b->bit_cnt);
   return file_write_at (file, b->bits, size, 0) == size;
 }
+
+/* Writes the part of B that holds bits START through START + CNT
+   - 1 to FILE, where bitmap_write() would put it, so that a small
+   change need not rewrite the whole file.  Whole elements are
+   written.  Returns true if successful, false otherwise. */
+bool
+bitmap_write_range (const struct bitmap *b, struct file *file,
+                    size_t start, size_t cnt)
+{
+  size_t first, last;
+  off_t ofs, size;
+
+  ASSERT (start <= b->bit_cnt);
+  ASSERT (start + cnt <= b->bit_cnt);
+  if (cnt == 0)
+    return true;
+  first = elem_idx (start);
+  last = elem_idx (start + cnt - 1);
+  ofs = first * sizeof (elem_type);
+  size = (last - first + 1) * sizeof (elem_type);
+  return file_write_at (file, b->bits + first, size, ofs) == size;
+}
 #endif /* FILESYS */
 
 /* Debugging. */
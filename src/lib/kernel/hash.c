@@ -31,6 +31,7 @@ hash_init (struct hash *h,
   h->hash = hash;
   h->less = less;
   h->aux = aux;
+  h->fixed = false;
 
   if (h->buckets != NULL) 
     {
@@ -339,6 +340,18 @@ is_power_of_2 (size_t x)
   return x != 0 && turn_off_least_1bit (x) == 0;
 }
 
+/* If FIXED, keeps the number of buckets in H as it is until this
+   is called again with FIXED false, so that hash_insert(),
+   hash_replace() and hash_delete() do not call malloc() or
+   free().  This is for code that may run inside the memory
+   allocator, which must not be reentered.  The table is resized
+   by the first change made after it is no longer fixed. */
+void
+hash_set_fixed (struct hash *h, bool fixed)
+{
+  h->fixed = fixed;
+}
+
 /* Element per bucket ratios. */
 #define MIN_ELEMS_PER_BUCKET  1 /* Elems/bucket < 1: reduce # of buckets. */
 #define BEST_ELEMS_PER_BUCKET 2 /* Ideal elems/bucket. */
@@ -357,6 +370,9 @@ rehash (struct hash *h)
 
   ASSERT (h != NULL);
 
+  if (h->fixed)
+    return;
+
   /* Save old bucket info for later use. */
   old_buckets = h->buckets;
   old_bucket_cnt = h->bucket_cnt;
@@ -64,6 +64,7 @@ struct hash
     hash_hash_func *hash;       /* Hash function. */
     hash_less_func *less;       /* Comparison function. */
     void *aux;                  /* Auxiliary data for `hash' and `less'. */
+    bool fixed;                 /* Keep bucket count?  See hash_set_fixed(). */
   };
 
 /* A hash table iterator. */
@@ -95,6 +96,9 @@ struct hash_elem *hash_cur (struct hash_iterator *);
 size_t hash_size (struct hash *);
 bool hash_empty (struct hash *);
 
+/* Resizing. */
+void hash_set_fixed (struct hash *, bool fixed);
+
 /* Sample hash functions. */
 unsigned hash_bytes (const void *, size_t);
 unsigned hash_string (const char *);
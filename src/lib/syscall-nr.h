@@ -28,7 +28,11 @@ enum
     SYS_MKDIR,                  /* Create a directory. */
     SYS_READDIR,                /* Reads a directory entry. */
     SYS_ISDIR,                  /* Tests if a fd represents a directory. */
-    SYS_INUMBER                 /* Returns the inode number for a fd. */
+    SYS_INUMBER,                /* Returns the inode number for a fd. */
+
+    /* Extensions. */
+    SYS_DIRECTIO,               /* Bypass the buffer cache for a fd. */
+    SYS_CACHESTAT               /* Reads the buffer cache counters. */
   };
 
 #endif /* lib/syscall-nr.h */
@@ -182,3 +182,15 @@ inumber (int fd)
 {
   return syscall1 (SYS_INUMBER, fd);
 }
+
+bool
+directio (int fd, bool enable)
+{
+  return syscall2 (SYS_DIRECTIO, fd, enable);
+}
+
+void
+cachestat (struct cache_stats *stats)
+{
+  syscall1 (SYS_CACHESTAT, stats);
+}
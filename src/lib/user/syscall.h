@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <debug.h>
+#include <cache-stats.h>
 
 /* Process identifier. */
 typedef int pid_t;
@@ -47,4 +48,8 @@ bool readdir (int fd, char name[READDIR_MAX_LEN + 1]);
 bool isdir (int fd);
 int inumber (int fd);
 
+/* Extensions. */
+bool directio (int fd, bool enable);
+void cachestat (struct cache_stats *);
+
 #endif /* lib/user/syscall.h */
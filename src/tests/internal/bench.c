@@ -0,0 +1,39 @@
+#include "tests/internal/bench.h"
+#include <debug.h>
+#include <string.h>
+#include <stdio.h>
+
+/* Benchmarks of kernel internals, run from the kernel command line
+   with the "bench" action, e.g. "pintos -- -q bench cache".  Each
+   prints its own table of timings and "NAME: PASS" at the end. */
+
+struct bench 
+  {
+    const char *name;
+    bench_func *function;
+  };
+
+static const struct bench benches[] = 
+  {
+    {"bitmap-scan", bench_bitmap_scan},
+    {"cache", bench_cache},
+    {"cache-policy", bench_cache_policy},
+    {"inode-open", bench_inode_open},
+    {"inode-random", bench_inode_random},
+  };
+
+/* Runs the benchmark named in ARGV[1]. */
+void
+run_bench (char **argv) 
+{
+  const char *name = argv[1];
+  const struct bench *b;
+
+  for (b = benches; b < benches + sizeof benches / sizeof *benches; b++)
+    if (!strcmp (name, b->name))
+      {
+        b->function ();
+        return;
+      }
+  PANIC ("no benchmark named \"%s\"", name);
+}
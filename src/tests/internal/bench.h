@@ -0,0 +1,14 @@
+#ifndef TESTS_INTERNAL_BENCH_H
+#define TESTS_INTERNAL_BENCH_H
+
+void run_bench (char **argv);
+
+typedef void bench_func (void);
+
+extern bench_func bench_bitmap_scan;
+extern bench_func bench_cache;
+extern bench_func bench_cache_policy;
+extern bench_func bench_inode_open;
+extern bench_func bench_inode_random;
+
+#endif /* tests/internal/bench.h */
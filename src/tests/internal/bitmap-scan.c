@@ -0,0 +1,125 @@
+/* Microbenchmark for bitmap_scan() in lib/kernel/bitmap.c.
+
+   Times the search for free runs in randomly fragmented bitmaps,
+   for the element-at-a-time scan bitmap_scan() now uses and for
+   the bit-at-a-time scan it replaced, which tested every starting
+   index in turn.  The old scan slows down with both the fullness
+   of the map and the length of run wanted; the new one mostly
+   with the number of free bits it has to step over.
+
+   Run it with "pintos -- -q bench bitmap-scan".
+*/
+
+#undef NDEBUG
+#include <bitmap.h>
+#include <debug.h>
+#include <inttypes.h>
+#include <random.h>
+#include <stdio.h>
+#include "devices/timer.h"
+#include "tests/internal/bench.h"
+
+/* Bits in each map. */
+#define MAP_BITS 16384
+
+/* Scans timed for each map and run length. */
+#define SCAN_CNT 100
+
+static int64_t time_word (struct bitmap *, size_t cnt);
+static int64_t time_bit (struct bitmap *, size_t cnt);
+static size_t scan_bit (const struct bitmap *, size_t start, size_t cnt);
+
+/* Time scans against fullness and run length. */
+void
+bench_bitmap_scan (void)
+{
+  static const int full[] = {50, 90, 99};
+  struct bitmap *map;
+  size_t i;
+
+  map = bitmap_create (MAP_BITS);
+  ASSERT (map != NULL);
+
+  printf ("%d scans of a %d-bit map, time in timer ticks\n",
+          SCAN_CNT, MAP_BITS);
+  printf ("%8s %8s %8s %8s\n", "full %", "run", "word", "bit");
+  for (i = 0; i < sizeof full / sizeof *full; i++)
+    {
+      size_t bit, cnt;
+
+      /* Set each bit with the given probability. */
+      for (bit = 0; bit < MAP_BITS; bit++)
+        bitmap_set (map, bit, (int) (random_ulong () % 100) < full[i]);
+
+      for (cnt = 1; cnt <= 16; cnt *= 4)
+        printf ("%8d %8zu %8"PRId64" %8"PRId64"\n", full[i], cnt,
+                time_word (map, cnt), time_bit (map, cnt));
+    }
+
+  bitmap_destroy (map);
+  printf ("bitmap-scan: PASS\n");
+}
+
+/* Returns a random starting point for a scan. */
+static size_t
+random_start (void)
+{
+  return random_ulong () % MAP_BITS;
+}
+
+/* Returns the ticks taken by SCAN_CNT scans of MAP for CNT clear
+   bits with bitmap_scan(), then checks each answer against the old
+   scan. */
+static int64_t
+time_word (struct bitmap *map, size_t cnt)
+{
+  static size_t from[SCAN_CNT], found[SCAN_CNT];
+  int64_t start;
+  int i;
+
+  for (i = 0; i < SCAN_CNT; i++)
+    from[i] = random_start ();
+
+  start = timer_ticks ();
+  for (i = 0; i < SCAN_CNT; i++)
+    found[i] = bitmap_scan (map, from[i], cnt, false);
+  start = timer_elapsed (start);
+
+  for (i = 0; i < SCAN_CNT; i++)
+    ASSERT (found[i] == scan_bit (map, from[i], cnt));
+  return start;
+}
+
+/* Returns the ticks taken by SCAN_CNT scans of MAP for CNT clear
+   bits with the old scan. */
+static int64_t
+time_bit (struct bitmap *map, size_t cnt)
+{
+  int64_t start = timer_ticks ();
+  int i;
+
+  for (i = 0; i < SCAN_CNT; i++)
+    scan_bit (map, random_start (), cnt);
+  return timer_elapsed (start);
+}
+
+/* The scan bitmap_scan() used to do: tests every starting index
+   from START on, one bit at a time, for CNT clear bits. */
+static size_t
+scan_bit (const struct bitmap *map, size_t start, size_t cnt)
+{
+  size_t last, i, j;
+
+  if (cnt > bitmap_size (map))
+    return BITMAP_ERROR;
+  last = bitmap_size (map) - cnt;
+  for (i = start; i <= last; i++)
+    {
+      for (j = 0; j < cnt; j++)
+        if (bitmap_test (map, i + j))
+          break;
+      if (j == cnt)
+        return i;
+    }
+  return BITMAP_ERROR;
+}
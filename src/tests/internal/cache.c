@@ -0,0 +1,113 @@
+/* Benchmark for cache hits in filesys/cache.c.
+
+   Resizes the buffer cache to a range of capacities, fills it by
+   loading that many sectors of the file system disk, and then
+   times random cache_load()/cache_release() pairs on them.  With
+   the hashed sector index a hit should cost the same however
+   large the cache is.  For comparison, it also times the scan of
+   every entry that the lookup did before the index.
+
+   The cache only grows while the kernel pool has memory to spare,
+   so on a small machine the largest sizes may not fit; the misses
+   column counts the timed loads that had to go to disk.
+
+   Only reads the disk.  Run it with "pintos -- -q bench cache" on
+   a file system disk of at least 1 MB.
+*/
+
+#undef NDEBUG
+#include <cache-stats.h>
+#include <debug.h>
+#include <inttypes.h>
+#include <random.h>
+#include <stdio.h>
+#include "devices/timer.h"
+#include "filesys/cache.h"
+#include "tests/internal/bench.h"
+
+/* Largest cache capacity that we will test, in sectors. */
+#define MAX_ENTRIES 2048
+
+/* Number of hits timed for each cache size. */
+#define LOOKUP_CNT 20000
+
+static int64_t time_loads (int cnt, long long *misses);
+static int64_t time_scans (int cnt);
+
+/* Time cache hits against cache size. */
+void
+bench_cache (void)
+{
+  int old_capacity = cache_capacity;
+  int cnt;
+
+  printf ("%d hits per size, time in timer ticks\n", LOOKUP_CNT);
+  printf ("%8s %8s %8s %8s\n", "entries", "load", "misses", "scan");
+  for (cnt = 16; cnt <= MAX_ENTRIES; cnt *= 2)
+    {
+      long long misses;
+      int64_t load_ticks;
+      int i;
+
+      cache_resize (cnt);
+      for (i = 0; i < cnt; i++)
+        cache_release (cache_load (i, CACHE_DATA), false);
+
+      load_ticks = time_loads (cnt, &misses);
+      printf ("%8d %8"PRId64" %8lld %8"PRId64"\n", cnt, load_ticks, misses,
+              time_scans (cnt));
+    }
+
+  cache_resize (old_capacity);
+  printf ("cache: PASS\n");
+}
+
+/* Returns the ticks taken by LOOKUP_CNT loads of random sectors
+   among the first CNT, which should all be cached, and stores in
+   *MISSES how many of them were not. */
+static int64_t
+time_loads (int cnt, long long *misses)
+{
+  struct cache_stats before, after;
+  int64_t start;
+  int i;
+
+  cache_get_stats (&before);
+  start = timer_ticks ();
+  for (i = 0; i < LOOKUP_CNT; i++)
+    cache_release (cache_load (random_ulong () % cnt, CACHE_DATA), false);
+  start = timer_elapsed (start);
+  cache_get_stats (&after);
+
+  *misses = after.misses - before.misses;
+  return start;
+}
+
+/* Returns the ticks taken by LOOKUP_CNT searches for random
+   sectors among the first CNT by scanning every cache entry in
+   turn, as the lookup did before the index.  The cache is not
+   changing, so the entries are read without its lock. */
+static int64_t
+time_scans (int cnt)
+{
+  int64_t start;
+  int found = 0;
+  int i;
+
+  start = timer_ticks ();
+  for (i = 0; i < LOOKUP_CNT; i++)
+    {
+      block_sector_t sector = random_ulong () % cnt;
+      int j;
+
+      for (j = 0; j < cache_capacity; j++)
+        if (cache[j].state != CACHE_FREE && cache[j].sector_id == sector)
+          {
+            found++;
+            break;
+          }
+    }
+  start = timer_elapsed (start);
+  ASSERT (found > 0);
+  return start;
+}
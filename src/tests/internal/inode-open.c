@@ -0,0 +1,156 @@
+/* Benchmark for the open inode table in filesys/inode.c.
+
+   Keeps a growing number of files open and times how long it
+   takes to resolve a deep path, which opens and closes an inode
+   for every component.  With open inodes kept in a hash table the
+   time should stay flat as more files are held open.
+
+   For comparison, it also times the searches the list that the
+   hash table replaced would have needed for the same lookups: a
+   scan of every open inode for each component, none of which is
+   held open.  The old lookup cost about the sum of the two.
+
+   Creates files and directories under "/bench-open", so run it on
+   a scratch file system with "pintos -- -q -f bench inode-open".
+*/
+
+#undef NDEBUG
+#include <debug.h>
+#include <inttypes.h>
+#include <list.h>
+#include <stdio.h>
+#include "devices/timer.h"
+#include "filesys/file.h"
+#include "filesys/filesys.h"
+#include "filesys/inode.h"
+#include "threads/malloc.h"
+#include "tests/internal/bench.h"
+
+/* Most files held open at once. */
+#define MAX_OPEN 1024
+
+/* Directories between the benchmark root and the leaf file. */
+#define DEPTH 16
+
+/* Path resolutions timed for each number of open files. */
+#define LOOKUP_CNT 2000
+
+static char leaf[32 + DEPTH * 4];
+
+/* An open inode on the list that the hash table replaced. */
+struct open_entry
+  {
+    struct list_elem elem;
+    block_sector_t sector;
+  };
+
+static void make_tree (void);
+static int64_t time_lookups (void);
+static int64_t time_scans (struct list *);
+
+/* Time deep path lookups against the number of open files. */
+void
+bench_inode_open (void)
+{
+  struct file **files;
+  struct open_entry *entries;
+  struct list open_list;
+  int open_cnt = 0;
+  int cnt;
+
+  files = malloc (sizeof *files * MAX_OPEN);
+  entries = malloc (sizeof *entries * MAX_OPEN);
+  ASSERT (files != NULL && entries != NULL);
+  list_init (&open_list);
+  make_tree ();
+
+  printf ("%d lookups of a %d-deep path, time in timer ticks\n",
+          LOOKUP_CNT, DEPTH);
+  printf ("%8s %8s %8s\n", "open", "lookup", "scan");
+  for (cnt = 16; cnt <= MAX_OPEN; cnt *= 2)
+    {
+      for (; open_cnt < cnt; open_cnt++)
+        {
+          char name[32];
+          snprintf (name, sizeof name, "/bench-open/f%d", open_cnt);
+          ASSERT (filesys_create (name, 0, false));
+          files[open_cnt] = filesys_open (name);
+          ASSERT (files[open_cnt] != NULL);
+          entries[open_cnt].sector
+            = inode_get_inumber (file_get_inode (files[open_cnt]));
+          list_push_front (&open_list, &entries[open_cnt].elem);
+        }
+      printf ("%8d %8"PRId64" %8"PRId64"\n", open_cnt, time_lookups (),
+              time_scans (&open_list));
+    }
+
+  while (open_cnt > 0)
+    file_close (files[--open_cnt]);
+  free (entries);
+  free (files);
+  printf ("inode-open: PASS\n");
+}
+
+/* Creates the benchmark root, DEPTH nested directories below it
+   and a file at the bottom, whose path goes into LEAF. */
+static void
+make_tree (void)
+{
+  int i, len;
+
+  ASSERT (filesys_create ("/bench-open", 0, true));
+  len = snprintf (leaf, sizeof leaf, "/bench-open");
+  for (i = 0; i < DEPTH; i++)
+    {
+      len += snprintf (leaf + len, sizeof leaf - len, "/d%d", i);
+      ASSERT (filesys_create (leaf, 0, true));
+    }
+  snprintf (leaf + len, sizeof leaf - len, "/leaf");
+  ASSERT (filesys_create (leaf, 0, false));
+}
+
+/* Returns the ticks taken to open and close LEAF LOOKUP_CNT
+   times. */
+static int64_t
+time_lookups (void)
+{
+  int64_t start = timer_ticks ();
+  int i;
+
+  for (i = 0; i < LOOKUP_CNT; i++)
+    {
+      struct file *file = filesys_open (leaf);
+      ASSERT (file != NULL);
+      file_close (file);
+    }
+  return timer_elapsed (start);
+}
+
+/* Returns the ticks taken by the searches of OPEN_LIST that
+   LOOKUP_CNT resolutions of LEAF would have made with the list:
+   one for the root, each directory and the leaf, all misses. */
+static int64_t
+time_scans (struct list *open_list)
+{
+  int64_t start = timer_ticks ();
+  int found = 0;
+  int i, j;
+
+  for (i = 0; i < LOOKUP_CNT; i++)
+    for (j = 0; j < DEPTH + 3; j++)
+      {
+        struct list_elem *e;
+
+        for (e = list_begin (open_list); e != list_end (open_list);
+             e = list_next (e))
+          if (list_entry (e, struct open_entry, elem)->sector
+              == (block_sector_t) -1)
+            {
+              found++;
+              break;
+            }
+      }
+  start = timer_elapsed (start);
+  ASSERT (found == 0);
+  return start;
+}
@@ -0,0 +1,125 @@
+/* Benchmark for random reads from a large file in filesys/inode.c.
+
+   Writes a file much larger than the buffer cache, large enough to
+   reach past the doubly indirect sector into the triply indirect
+   one, then times random single-sector reads in each part of it.
+   The top indirect sectors are kept in memory while the file is
+   open, so a read should cost at most one cache miss for its data
+   plus one for doubly indirect data and two for triply indirect
+   data, however large the file.
+
+   Creates "/bench-random", so run it on a scratch file system of
+   at least 16 MB with "pintos -- -q -f bench inode-random".
+*/
+
+#undef NDEBUG
+#include <cache-stats.h>
+#include <debug.h>
+#include <inttypes.h>
+#include <random.h>
+#include <stdio.h>
+#include "devices/timer.h"
+#include "filesys/cache.h"
+#include "filesys/file.h"
+#include "filesys/filesys.h"
+#include "threads/malloc.h"
+#include "tests/internal/bench.h"
+
+/* Size of the file, in sectors: 12 MB. */
+#define FILE_SECTORS (24 * 1024)
+
+/* Sectors written at a time while creating the file. */
+#define CHUNK_SECTORS 8
+
+/* Random reads timed in each part of the file. */
+#define READ_CNT 2000
+
+/* Parts of the file, by the sectors that map them. */
+struct region
+  {
+    const char *name;
+    int first, last;                    /* File sectors, inclusive. */
+  };
+
+static const struct region regions[] =
+  {
+    {"direct", 0, 99},
+    {"doubly", 100, 100 + 128 * 128 - 1},
+    {"triply", 100 + 128 * 128, FILE_SECTORS - 1},
+  };
+
+static void write_file (struct file *);
+static void time_reads (struct file *, const struct region *);
+
+/* Time random reads against the part of a large file they hit. */
+void
+bench_inode_random (void)
+{
+  struct file *file;
+  size_t i;
+
+  ASSERT (filesys_create ("/bench-random", 0, false));
+  file = filesys_open ("/bench-random");
+  ASSERT (file != NULL);
+  write_file (file);
+
+  printf ("%d random reads per region of a %d-sector file\n",
+          READ_CNT, FILE_SECTORS);
+  printf ("%8s %8s %12s\n", "region", "ticks", "misses/read");
+  for (i = 0; i < sizeof regions / sizeof *regions; i++)
+    time_reads (file, &regions[i]);
+
+  file_close (file);
+  printf ("inode-random: PASS\n");
+}
+
+/* Fills FILE with FILE_SECTORS sectors, each starting with its own
+   sector number. */
+static void
+write_file (struct file *file)
+{
+  int *buf = malloc (CHUNK_SECTORS * BLOCK_SECTOR_SIZE);
+  int sector;
+
+  ASSERT (buf != NULL);
+  for (sector = 0; sector < FILE_SECTORS; sector += CHUNK_SECTORS)
+    {
+      int i;
+
+      for (i = 0; i < CHUNK_SECTORS; i++)
+        buf[i * BLOCK_SECTOR_SIZE / sizeof *buf] = sector + i;
+      ASSERT (file_write (file, buf, CHUNK_SECTORS * BLOCK_SECTOR_SIZE)
+              == CHUNK_SECTORS * BLOCK_SECTOR_SIZE);
+    }
+  free (buf);
+}
+
+/* Reads READ_CNT random sectors of REGION from FILE, checks them
+   and prints the time and cache misses taken. */
+static void
+time_reads (struct file *file, const struct region *region)
+{
+  struct cache_stats before, after;
+  int buf[BLOCK_SECTOR_SIZE / sizeof (int)];
+  int64_t start;
+  long long misses;
+  int i;
+
+  cache_get_stats (&before);
+  start = timer_ticks ();
+  for (i = 0; i < READ_CNT; i++)
+    {
+      int sector = region->first
+                   + random_ulong () % (region->last - region->first + 1);
+      file_seek (file, sector * BLOCK_SECTOR_SIZE);
+      ASSERT (file_read (file, buf, sizeof buf) == sizeof buf);
+      ASSERT (buf[0] == sector);
+    }
+  start = timer_elapsed (start);
+  cache_get_stats (&after);
+
+  /* No floating point in the kernel: print hundredths. */
+  misses = (after.misses - before.misses) * 100 / READ_CNT;
+  printf ("%8s %8"PRId64" %9lld.%02lld\n", region->name, start,
+          misses / 100, misses % 100);
+}
@@ -34,8 +34,10 @@
 #ifdef FILESYS
 #include "devices/block.h"
 #include "devices/ide.h"
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
+#include "tests/internal/bench.h"
 #endif
 
 /* Page directory with kernel mappings only. */
@@ -247,6 +249,27 @@ parse_options (char **argv)
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-extents"))
+        filesys_extents = true;
+      else if (!strcmp (name, "-wb"))
+        {
+          if (value == NULL || atoi (value) <= 0)
+            PANIC ("bad write-behind interval `%s' (use -h for help)",
+                   value);
+          cache_flush_interval = atoi (value);
+        }
+      else if (!strcmp (name, "-cache-size"))
+        {
+          if (value == NULL || atoi (value) <= 0)
+            PANIC ("bad cache size `%s' (use -h for help)", value);
+          cache_capacity = atoi (value);
+        }
+      else if (!strcmp (name, "-cache-pct"))
+        {
+          if (value == NULL || atoi (value) <= 0 || atoi (value) > 100)
+            PANIC ("bad cache percentage `%s' (use -h for help)", value);
+          cache_percent = atoi (value);
+        }
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -256,6 +279,17 @@ parse_options (char **argv)
         random_init (atoi (value));
       else if (!strcmp (name, "-mlfqs"))
         thread_mlfqs = true;
+#ifdef FILESYS
+      else if (!strcmp (name, "-cache"))
+        {
+          if (value != NULL && !strcmp (value, "clock"))
+            cache_policy = CACHE_CLOCK;
+          else if (value != NULL && !strcmp (value, "2q"))
+            cache_policy = CACHE_2Q;
+          else
+            PANIC ("unknown cache policy `%s' (use -h for help)", value);
+        }
+#endif
 #ifdef USERPROG
       else if (!strcmp (name, "-ul"))
         user_page_limit = atoi (value);
@@ -315,6 +349,7 @@ run_actions (char **argv)
       {"rm", 2, fsutil_rm},
       {"extract", 1, fsutil_extract},
       {"append", 2, fsutil_append},
+      {"bench", 2, run_bench},
 #endif
       {NULL, 0, NULL},
     };
@@ -364,6 +399,7 @@ usage (void)
           "Use these actions indirectly via `pintos' -g and -p options:\n"
           "  extract            Untar from scratch device into file system.\n"
           "  append FILE        Append FILE to tar file on scratch device.\n"
+          "  bench NAME         Run kernel benchmark NAME.\n"
 #endif
           "\nOptions:\n"
           "  -h                 Print this help message and power off.\n"
@@ -373,12 +409,19 @@ usage (void)
           "  -f                 Format file system device during startup.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -extents           With -f, map file data with extent trees.\n"
+          "  -wb=MS             Write dirty cache sectors back every MS ms.\n"
+          "  -cache-size=N      Let the buffer cache grow to N sectors.\n"
+          "  -cache-pct=PCT     Let the buffer cache grow to PCT%% of kernel pool.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
 #endif
           "  -rs=SEED           Set random number seed to SEED.\n"
           "  -mlfqs             Use multi-level feedback queue scheduler.\n"
+#ifdef FILESYS
+          "  -cache=POLICY      Use POLICY (clock or 2q) for the buffer cache.\n"
+#endif
 #ifdef USERPROG
           "  -ul=COUNT          Limit user memory to COUNT pages.\n"
 #endif
@@ -36,6 +36,9 @@ struct pool
 /* Two pools: one for kernel data, one for user pages. */
 static struct pool kernel_pool, user_pool;
 
+/* Called to free kernel pages when the kernel pool runs out. */
+static palloc_reclaim_func *reclaim;
+
 static void init_pool (struct pool *, void *base, size_t page_cnt,
                        const char *name);
 static bool page_from_pool (const struct pool *, void *page);
@@ -81,6 +84,16 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
   page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
   lock_release (&pool->lock);
 
+  /* Out of kernel pages: ask the reclaimer to give some back, then
+     try once more. */
+  if (page_idx == BITMAP_ERROR && pool == &kernel_pool
+      && reclaim != NULL && reclaim (page_cnt))
+    {
+      lock_acquire (&pool->lock);
+      page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
+      lock_release (&pool->lock);
+    }
+
   if (page_idx != BITMAP_ERROR)
     pages = pool->base + PGSIZE * page_idx;
   else
@@ -148,6 +161,38 @@ palloc_free_page (void *page)
   palloc_free_multiple (page, 1);
 }
 
+/* Sets the function called to free kernel pages when the kernel
+   pool is exhausted.  It may be called with any lock held, so it
+   must not block on one. */
+void
+palloc_set_reclaim (palloc_reclaim_func *func)
+{
+  reclaim = func;
+}
+
+/* Returns the number of free pages in the user pool if PAL_USER
+   is set in FLAGS, otherwise in the kernel pool. */
+size_t
+palloc_free_cnt (enum palloc_flags flags)
+{
+  struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+  size_t cnt;
+
+  lock_acquire (&pool->lock);
+  cnt = bitmap_count (pool->used_map, 0, bitmap_size (pool->used_map), false);
+  lock_release (&pool->lock);
+  return cnt;
+}
+
+/* Returns the total number of pages in the user pool if PAL_USER
+   is set in FLAGS, otherwise in the kernel pool. */
+size_t
+palloc_pool_size (enum palloc_flags flags)
+{
+  struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+  return bitmap_size (pool->used_map);
+}
+
 /* Initializes pool P as starting at START and ending at END,
    naming it NAME for debugging purposes. */
 static void
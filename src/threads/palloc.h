@@ -1,6 +1,7 @@
 #ifndef THREADS_PALLOC_H
 #define THREADS_PALLOC_H
 
+#include <stdbool.h>
 #include <stddef.h>
 
 /* How to allocate pages. */
@@ -11,10 +12,17 @@ enum palloc_flags
     PAL_USER = 004              /* User page. */
   };
 
+/* Asked to free up to PAGE_CNT kernel pages when the kernel pool
+   runs out.  Returns true if it freed any. */
+typedef bool palloc_reclaim_func (size_t page_cnt);
+
 void palloc_init (size_t user_page_limit);
 void *palloc_get_page (enum palloc_flags);
 void *palloc_get_multiple (enum palloc_flags, size_t page_cnt);
 void palloc_free_page (void *);
 void palloc_free_multiple (void *, size_t page_cnt);
+void palloc_set_reclaim (palloc_reclaim_func *);
+size_t palloc_free_cnt (enum palloc_flags);
+size_t palloc_pool_size (enum palloc_flags);
 
 #endif /* threads/palloc.h */
@@ -336,3 +336,89 @@ cond_broadcast (struct condition *cond, struct lock *lock)
   while (!list_empty (&cond->waiters))
     cond_signal (cond, lock);
 }
+
+/* Initializes RWLOCK.  Any number of readers may hold a
+   readers-writer lock at once, or a single writer. */
+void
+rwlock_init (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+
+  lock_init (&rwlock->lock);
+  cond_init (&rwlock->readers);
+  cond_init (&rwlock->writers);
+  rwlock->reader_cnt = 0;
+  rwlock->writer_cnt = 0;
+  rwlock->writer = NULL;
+}
+
+/* Acquires RWLOCK for reading, sleeping while a writer holds it.
+   New readers also wait while a writer is waiting, so that a
+   steady stream of readers cannot starve writers.  A thread
+   already holding RWLOCK for reading must not acquire it again.
+
+   This function may sleep, so it must not be called within an
+   interrupt handler. */
+void
+rwlock_acquire_read (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+  ASSERT (!intr_context ());
+
+  lock_acquire (&rwlock->lock);
+  while (rwlock->writer_cnt > 0)
+    cond_wait (&rwlock->readers, &rwlock->lock);
+  rwlock->reader_cnt++;
+  lock_release (&rwlock->lock);
+}
+
+/* Releases RWLOCK, which the current thread holds for reading. */
+void
+rwlock_release_read (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+
+  lock_acquire (&rwlock->lock);
+  ASSERT (rwlock->reader_cnt > 0);
+  if (--rwlock->reader_cnt == 0)
+    cond_signal (&rwlock->writers, &rwlock->lock);
+  lock_release (&rwlock->lock);
+}
+
+/* Acquires RWLOCK for writing, sleeping until no other thread
+   holds it.  The current thread must not already hold it.
+
+   This function may sleep, so it must not be called within an
+   interrupt handler. */
+void
+rwlock_acquire_write (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+  ASSERT (!intr_context ());
+  ASSERT (rwlock->writer != thread_current ());
+
+  lock_acquire (&rwlock->lock);
+  rwlock->writer_cnt++;
+  while (rwlock->reader_cnt > 0 || rwlock->writer != NULL)
+    cond_wait (&rwlock->writers, &rwlock->lock);
+  rwlock->writer = thread_current ();
+  lock_release (&rwlock->lock);
+}
+
+/* Releases RWLOCK, which the current thread holds for writing.
+   Waiting writers go first; readers are let in once there are
+   none. */
+void
+rwlock_release_write (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+  ASSERT (rwlock->writer == thread_current ());
+
+  lock_acquire (&rwlock->lock);
+  rwlock->writer = NULL;
+  if (--rwlock->writer_cnt > 0)
+    cond_signal (&rwlock->writers, &rwlock->lock);
+  else
+    cond_broadcast (&rwlock->readers, &rwlock->lock);
+  lock_release (&rwlock->lock);
+}
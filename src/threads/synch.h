@@ -41,6 +41,23 @@ void cond_wait (struct condition *, struct lock *);
 void cond_signal (struct condition *, struct lock *);
 void cond_broadcast (struct condition *, struct lock *);
 
+/* Readers-writer lock. */
+struct rwlock
+  {
+    struct lock lock;           /* Protects the members below. */
+    struct condition readers;   /* Signaled when readers may enter. */
+    struct condition writers;   /* Signaled when a writer may enter. */
+    int reader_cnt;             /* Readers holding the lock. */
+    int writer_cnt;             /* Writers waiting or holding it. */
+    struct thread *writer;      /* Writer holding it, if any. */
+  };
+
+void rwlock_init (struct rwlock *);
+void rwlock_acquire_read (struct rwlock *);
+void rwlock_release_read (struct rwlock *);
+void rwlock_acquire_write (struct rwlock *);
+void rwlock_release_write (struct rwlock *);
+
 /* Optimization barrier.
 
    The compiler will not reorder operations across an
@@ -110,6 +110,9 @@ struct thread
 
     struct dir *current_dir;
 
+    /* Owned by devices/timer.c. */
+    int64_t wakeup_tick;                /* Tick to wake up at in timer_sleep(). */
+
     /* Owned by thread.c. */
     unsigned magic;                     /* Detects stack overflow. */
   };
@@ -9,6 +9,7 @@
 #include "filesys/file.h"
 #include "filesys/inode.h"
 #include "filesys/filesys.h"
+#include "filesys/cache.h"
 
 static void syscall_handler (struct intr_frame *);
 
@@ -30,6 +31,8 @@ bool mkdir(const char *dir);
 bool readdir(int fd, const char *name);
 bool isdir(int fd);
 int inumber(int fd);
+bool directio(int fd, bool enable);
+void cachestat(struct cache_stats *stats);
 
 struct lock filesys_lock;
 
@@ -183,6 +186,17 @@ syscall_handler (struct intr_frame *f)
     get_args(esp, args, 1);
     f->eax = inumber(args[0]);
   }
+  else if(call_num == SYS_DIRECTIO)
+  {
+    get_args(esp, args, 2);
+    f->eax = directio(args[0], args[1]);
+  }
+  else if(call_num == SYS_CACHESTAT)
+  {
+    get_args(esp, args, 1);
+    check_valid_buffer((char *) args[0], sizeof(struct cache_stats));
+    cachestat((struct cache_stats *) args[0]);
+  }
   else
   {
   	printf("Not known (yet) syscall.\n");
@@ -260,9 +274,7 @@ int filesize (int fd )
 {
   struct file_descriptor *file_desc = process_get_fd(fd);
   if(!file_desc || !file_desc->file) return -1;
-  lock_acquire(&filesys_lock);
   int res = file_length(file_desc->file);
-  lock_release(&filesys_lock);
   return res;
 }
 int read (int fd , void * buffer , unsigned size )
@@ -279,9 +291,7 @@ int read (int fd , void * buffer , unsigned size )
 
   struct file_descriptor *file_desc = process_get_fd(fd);
   if(!file_desc || !file_desc->file) return 0;
-  lock_acquire(&filesys_lock);
   int bytes_read = file_read(file_desc->file, buffer, size);
-  lock_release(&filesys_lock);
   return bytes_read;
 }
 int write (int fd , const void * buffer , unsigned size )
@@ -293,26 +303,20 @@ int write (int fd , const void * buffer , unsigned size )
   }
   struct file_descriptor *file_desc = process_get_fd(fd);
   if(!file_desc || file_desc->file == NULL) return -1;
-  lock_acquire(&filesys_lock);
   int bytes_written = file_write(file_desc->file, buffer, size);
-  lock_release(&filesys_lock);
   return bytes_written;
 }
 void seek (int fd , unsigned position )
 {
   struct file_descriptor *file_desc = process_get_fd(fd);
   if(!file_desc || !file_desc->file) return -1;
-  lock_acquire(&filesys_lock);
   file_seek(file_desc->file, position);
-  lock_release(&filesys_lock);
 }
 unsigned tell (int fd )
 {
   struct file_descriptor *file_desc = process_get_fd(fd);
   if(!file_desc || !file_desc->file) return -1;
-  lock_acquire(&filesys_lock);
   int res = file_tell(file_desc->file);
-  lock_release(&filesys_lock);
   return res;
 }
 void close (int fd )
@@ -380,4 +384,17 @@ int inumber(int fd)
   if(!file_desc) return -1;
   if(file_desc->file) return inode_get_inumber(file_get_inode(file_desc->file));
   return inode_get_inumber(dir_get_inode(file_desc->dir));
-}
\ No newline at end of file
+}
+
+bool directio(int fd, bool enable)
+{
+  struct file_descriptor *file_desc = process_get_fd(fd);
+  if(!file_desc || !file_desc->file) return false;
+  file_set_direct(file_desc->file, enable);
+  return true;
+}
+
+void cachestat(struct cache_stats *stats)
+{
+  cache_get_stats(stats);
+}